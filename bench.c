@@ -0,0 +1,376 @@
+/*
+
+    ttcdt-huff - Huffman encoding library.
+
+    ttcdt <dev@triptico.com>
+
+    This software is released into the public domain.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/* the library is built in, to reach the internals of each phase */
+#include "ttcdt-huff.c"
+
+/* minimum time to measure each thing, in seconds */
+#define MIN_TIME 0.2
+
+/* longest code, as the library uses */
+#define MAX_BITS 15
+
+/* interleaved streams of the stream decoding phase */
+#define STREAMS 4
+
+/* buffers */
+unsigned char *ib;
+unsigned char *cb;
+unsigned char *db;
+size_t uz;
+
+/** corpora **/
+
+uint32_t seed;
+
+uint32_t rnd(void)
+/* xorshift32 */
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return seed;
+}
+
+
+void gen_text(unsigned char *b, size_t z)
+/* words from a small vocabulary, with the most common ones
+   much more frequent (roughly Zipf) */
+{
+    static const char *words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it",
+        "as", "was", "with", "be", "by", "on", "not", "he", "this", "are",
+        "or", "his", "from", "at", "which", "but", "have", "an", "had", "they",
+        "you", "were", "their", "one", "all", "we", "can", "her", "has", "there",
+        "been", "if", "more", "when", "will", "would", "who", "so", "no", "Carcosa",
+        "Hastur", "yellow", "king", "lake", "Hali", "towers", "moons", "shadows"
+    };
+    int nw = sizeof(words) / sizeof(words[0]);
+    size_t n = 0;
+
+    while (n < z) {
+        /* the product of two uniform values favours the lower ones */
+        const char *w = words[((rnd() % nw) * (rnd() % nw)) / nw];
+
+        while (*w && n < z)
+            b[n++] = *w++;
+
+        if (n < z)
+            b[n++] = rnd() % 12 ? ' ' : rnd() % 2 ? '\n' : '.';
+    }
+}
+
+
+void gen_skewed(unsigned char *b, size_t z)
+/* bytes with a geometric distribution */
+{
+    size_t n;
+
+    for (n = 0; n < z; n++) {
+        uint32_t r = rnd();
+        int c = 0;
+
+        while ((r & 1) && c < 255) {
+            r >>= 1;
+            c++;
+
+            if (c % 31 == 0)
+                r = rnd();
+        }
+
+        b[n] = c;
+    }
+}
+
+
+void gen_sparse(unsigned char *b, size_t z)
+/* mostly zeros, with a few small values: symbols
+   take much less than a bit */
+{
+    size_t n;
+
+    for (n = 0; n < z; n++) {
+        uint32_t r = rnd();
+
+        b[n] = (r & 0xff) < 240 ? 0 : 1 + (r >> 8) % 15;
+    }
+}
+
+
+void gen_random(unsigned char *b, size_t z)
+/* uniformly distributed bytes */
+{
+    size_t n;
+
+    for (n = 0; n < z; n++)
+        b[n] = rnd() >> 24;
+}
+
+
+void gen_runs(unsigned char *b, size_t z)
+/* long runs of a few symbols */
+{
+    size_t n = 0;
+
+    while (n < z) {
+        unsigned char c = 'a' + rnd() % 8;
+        size_t l = 64 + rnd() % 4096;
+
+        while (l-- && n < z)
+            b[n++] = c;
+    }
+}
+
+
+void gen_single(unsigned char *b, size_t z)
+/* only one symbol */
+{
+    memset(b, 'x', z);
+}
+
+
+struct corpus {
+    const char *name;
+    void (*gen)(unsigned char *, size_t);
+} corpora[] = {
+    { "text",   gen_text },
+    { "skewed", gen_skewed },
+    { "sparse", gen_sparse },
+    { "random", gen_random },
+    { "runs",   gen_runs },
+    { "single", gen_single },
+    { NULL,     NULL }
+};
+
+size_t sizes[] = {
+    64, 4096, 256 * 1024, 4 * 1024 * 1024, 64 * 1024 * 1024, 0
+};
+
+
+/** timing **/
+
+double now(void)
+/* monotonic time in seconds */
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/* phase state, shared by the measured functions */
+size_t freqs[256];
+int n_bits[256];
+uint32_t codes[256];
+unsigned char syms[256];
+unsigned char lb[512];
+int z_syms;
+size_t cz;
+struct table dt;
+struct multi dm[1 << TABLE_BITS];
+
+void ph_compress(void)
+{
+    cz = ttcdt_huff_compress_z(ib, uz, cb) - cb;
+}
+
+void ph_decompress(void)
+{
+    ttcdt_huff_decompress(cb, db);
+}
+
+void ph_histogram(void)
+{
+    ttcdt_huff_histogram(ib, uz, freqs);
+}
+
+void ph_tree(void)
+{
+    z_syms = ttcdt_huff_build_lengths(freqs, MAX_BITS, n_bits, syms);
+    ttcdt_huff_canonical(n_bits, codes);
+}
+
+void ph_header(void)
+{
+    ttcdt_huff_compress_lengths(syms, z_syms, n_bits, lb);
+}
+
+void ph_read_header(void)
+{
+    int nb[256], single;
+    uint32_t c[256];
+
+    ttcdt_huff_decompress_lengths(lb, nb, c, &single);
+}
+
+void ph_encode(void)
+{
+    ttcdt_huff_compress_stream(ib, uz, cb, n_bits, codes);
+}
+
+void ph_decode_1(void)
+{
+    ttcdt_huff_decompress_stream(&dt, cb, uz, db);
+}
+
+void ph_decode_n(void)
+{
+    ttcdt_huff_decompress_streams(&dt, cb, uz, db);
+}
+
+
+void encode_streams(int streams)
+/* encodes @ib into @cb as the stream part of a block, split in
+   @streams interleaved streams (as ttcdt_huff_compress_ctx() does),
+   and builds the decoding table for it */
+{
+    unsigned char *ob = cb;
+    size_t q = uz / streams;
+    int n, i;
+
+    if (streams > 1) {
+        unsigned char *sz;
+        int w = size_width(n_bits, uz, streams);
+
+        *ob++ = streams | (w << 4);
+
+        sz = ob;
+        ob += (streams - 1) * w;
+
+        for (i = 0; i < streams; i++) {
+            unsigned char *s = ob;
+
+            if (i < streams - 1) {
+                ob = ttcdt_huff_compress_stream(ib + i * q, q, ob, n_bits, codes);
+
+                for (n = 0; n < w; n++)
+                    *sz++ = (uint64_t)(ob - s) >> (n * 8);
+            }
+            else
+                ob = ttcdt_huff_compress_stream(ib + i * q, uz - i * q, ob, n_bits, codes);
+        }
+    }
+    else
+        ttcdt_huff_compress_stream(ib, uz, ob, n_bits, codes);
+
+    dt.m = dm;
+    ttcdt_huff_build_table(n_bits, codes,
+        z_syms == 1 && n_bits[syms[0]] == 0 ? syms[0] : -1, &dt);
+}
+
+
+double measure(void (*f)(void))
+/* runs @f until MIN_TIME has passed. Returns the seconds per run */
+{
+    double t0, t;
+    long n = 0;
+
+    t0 = now();
+
+    do {
+        f();
+        n++;
+    } while ((t = now() - t0) < MIN_TIME);
+
+    return t / n;
+}
+
+
+double ns_byte(double t)
+{
+    return t * 1e9 / uz;
+}
+
+
+double mb_s(double t)
+{
+    return uz / t / 1e6;
+}
+
+
+/** code **/
+
+int main(int argc, char *argv[])
+{
+    size_t max = argc > 1 ? strtoul(argv[1], NULL, 0) : sizes[4];
+    int c, s, ret = 0;
+
+    ib = malloc(sizes[4]);
+    cb = malloc(sizes[4] * 2 + 1024);
+    db = malloc(sizes[4]);
+
+    printf("%-7s %9s %7s %9s %9s %7s %7s | %6s %6s %6s %6s %6s %6s %6s\n",
+        "corpus", "size", "ratio", "C MB/s", "D MB/s", "C ns/B", "D ns/B",
+        "hist", "tree", "hdr", "enc", "hdr-in", "dec-1", "dec-4");
+    printf("%-7s %9s %7s %9s %9s %7s %7s | %48s\n",
+        "", "", "", "", "", "", "", "(ns/byte; tree, hdr, hdr-in: ns)");
+
+    for (c = 0; corpora[c].name; c++) {
+        for (s = 0; sizes[s] && sizes[s] <= max; s++) {
+            double tc, td, th, tt, tw, te, tr, t1, tn;
+
+            uz   = sizes[s];
+            seed = 0x12345678;
+            corpora[c].gen(ib, uz);
+
+            tc = measure(ph_compress);
+            td = measure(ph_decompress);
+
+            if (memcmp(ib, db, uz) != 0) {
+                printf("%-7s %9lu *** round trip failed ***\n",
+                    corpora[c].name, (unsigned long)uz);
+                ret = 1;
+                continue;
+            }
+
+            th = measure(ph_histogram);
+            tt = measure(ph_tree);
+            tw = measure(ph_header);
+            tr = measure(ph_read_header);
+            te = measure(ph_encode);
+
+            /* the stream decoding alone, in one and in interleaved streams */
+            encode_streams(1);
+            memset(db, '\0', uz);
+            t1 = measure(ph_decode_1);
+
+            if (memcmp(ib, db, uz) != 0)
+                ret = 1;
+
+            encode_streams(STREAMS);
+            memset(db, '\0', uz);
+            tn = measure(ph_decode_n);
+
+            if (memcmp(ib, db, uz) != 0)
+                ret = 1;
+
+            printf("%-7s %9lu %7.3f %9.1f %9.1f %7.2f %7.2f | %6.2f %6.0f %6.0f %6.2f %6.0f %6.2f %6.2f%s\n",
+                corpora[c].name, (unsigned long)uz, (double)cz / uz,
+                mb_s(tc), mb_s(td), ns_byte(tc), ns_byte(td),
+                ns_byte(th), tt * 1e9, tw * 1e9, ns_byte(te), tr * 1e9,
+                ns_byte(t1), ns_byte(tn), ret ? " *** stream round trip failed ***" : "");
+        }
+    }
+
+    free(db);
+    free(cb);
+    free(ib);
+
+    return ret;
+}
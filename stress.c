@@ -9,10 +9,14 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "ttcdt-huff.h"
 
+/* a table generated by ttcdt-huff-train, as programs use them */
+#include "stress-table.h"
+
 /* total number of tests and oks */
 int tests = 0;
 int oks = 0;
@@ -46,11 +50,11 @@ void _do_test(char *str, int ok, int src_line)
 #define do_test(str, ok) _do_test(str, ok, __LINE__)
 
 
-unsigned char udata[30000];
+unsigned char udata[1000000];
 int uz;
-unsigned char cdata[30000];
+unsigned char cdata[1000000];
 int cz;
-unsigned char buf[30000];
+unsigned char buf[1000000];
 int bz;
 
 void test_1(char *id)
@@ -69,6 +73,7 @@ void test_1(char *id)
         printf("test: %s -- uz: %d, cz: %d, bz: %d\n", id, uz, cz, bz);
 
     do_test("Data size stored in compressed block", bz == uz);
+    do_test("Compressed size within TTCDT_HUFF_BOUND()", cz <= TTCDT_HUFF_BOUND(uz));
 
     ptr = ttcdt_huff_decompress(cdata, buf);
 
@@ -76,6 +81,734 @@ void test_1(char *id)
 
     if (ptr != NULL)
         do_test("Pre-compressed un-compressed comparison", memcmp(udata, buf, uz) == 0);
+
+    memset(buf, '\0', sizeof(buf));
+
+    ptr = ttcdt_huff_compress_streams(udata, uz, cdata, 4);
+    cz = ptr - cdata;
+
+    do_test("Interleaved streams: within TTCDT_HUFF_BOUND()", cz <= TTCDT_HUFF_BOUND(uz));
+
+    ptr = ttcdt_huff_decompress(cdata, buf);
+
+    do_test("Interleaved streams: all input consumed", ptr == cdata + cz);
+    do_test("Interleaved streams: comparison", memcmp(udata, buf, uz) == 0);
+}
+
+
+/* a block compressed by version 1.06 (serialized tree) */
+unsigned char v1_block[] = {
+    0xd4, 0x00, 0x00, 0x1a, 0x82, 0x4d, 0x2e, 0x90, 0xc4, 0x05, 0xb3, 0x05,
+    0x12, 0xc3, 0x28, 0x32, 0xdd, 0x61, 0x05, 0x38, 0x41, 0x9e, 0x19, 0x98,
+    0x0c, 0x3a, 0x0d, 0x08, 0x80, 0x43, 0xc0, 0xe0, 0xd0, 0x28, 0x38, 0x0c,
+    0x0a, 0x01, 0x03, 0x01, 0x00, 0x84, 0x02, 0x3e, 0x0f, 0x0b, 0x81, 0xc3,
+    0x60, 0xb0, 0x28, 0x24, 0x2c, 0x06, 0x09, 0x00, 0x81, 0x01, 0x50, 0xc8,
+    0x0a, 0x39, 0x0c, 0x8a, 0x41, 0x23, 0x10, 0x88, 0x94, 0x2a, 0x00, 0x16,
+    0x83, 0x46, 0xa1, 0xd1, 0xe8, 0x0c, 0x46, 0x00, 0xe7, 0x70, 0x04, 0x43,
+    0x5d, 0xf5, 0x8f, 0x5d, 0x93, 0xdd, 0x79, 0xd2, 0x1a, 0x65, 0xeb, 0x58,
+    0x58, 0x6a, 0xd2, 0x5a, 0x7d, 0xfc, 0x79, 0xf4, 0x00
+};
+
+void test_v1(void)
+{
+    const char *str = "A Huffman block, as stored by version 1.06.";
+    const unsigned char *ptr;
+
+    memset(buf, '\0', sizeof(buf));
+
+    ttcdt_huff_size(v1_block, &bz);
+
+    do_test("Version 1 block: data size", bz == strlen(str));
+
+    ptr = ttcdt_huff_decompress(v1_block, buf);
+
+    do_test("Version 1 block: decompression", ptr == v1_block + sizeof(v1_block));
+    do_test("Version 1 block: data", memcmp(buf, str, strlen(str)) == 0);
+}
+
+
+void test_large(void)
+{
+    size_t z = 20 * 1024 * 1024, dz = 0, n;
+    unsigned char *ub, *cb, *db;
+    const unsigned char *ptr;
+
+    ub = malloc(z);
+    cb = malloc(z + z / 2);
+    db = malloc(z);
+
+    /* bigger than the 24-bit size of the old block format */
+    for (n = 0; n < z; n++)
+        ub[n] = udata[n % 8045] ^ (n >> 20);
+
+    ptr = ttcdt_huff_compress_z(ub, z, cb);
+
+    ttcdt_huff_size_z(cb, &dz);
+
+    if (verbose)
+        printf("test: large block -- uz: %lu, cz: %lu\n",
+            (unsigned long)z, (unsigned long)(ptr - cb));
+
+    do_test("Large block: data size", dz == z);
+
+    ptr = ttcdt_huff_decompress(cb, db);
+
+    do_test("Large block: decompression", ptr != NULL);
+    do_test("Large block: comparison", memcmp(ub, db, z) == 0);
+
+    free(db);
+    free(cb);
+    free(ub);
+}
+
+
+void test_histogram(void)
+{
+    size_t freqs[256];
+    size_t check[256];
+    int n, m, ok = 1;
+
+    /* all lengths around the word size, at all alignments */
+    for (n = 0; n < 40; n++) {
+        for (m = 0; m < 8; m++) {
+            int i;
+
+            ttcdt_huff_histogram(udata + m, n, freqs);
+
+            memset(check, '\0', sizeof(check));
+            for (i = 0; i < n; i++)
+                check[udata[m + i]]++;
+
+            if (memcmp(freqs, check, sizeof(freqs)) != 0)
+                ok = 0;
+        }
+    }
+
+    do_test("Histogram of short buffers", ok);
+
+    ttcdt_huff_histogram(udata, uz, freqs);
+
+    memset(check, '\0', sizeof(check));
+    for (n = 0; n < uz; n++)
+        check[udata[n]]++;
+
+    do_test("Histogram of a long buffer", memcmp(freqs, check, sizeof(freqs)) == 0);
+}
+
+
+void test_ctx(void)
+{
+    ttcdt_huff_ctx *ctx;
+    const unsigned char *ptr;
+    unsigned char *cptr;
+    int n, ok = 1;
+
+    ctx = ttcdt_huff_ctx_new(4, 12);
+
+    do_test("Context: created", ctx != NULL);
+
+    /* blocks with the same and with different distributions */
+    cptr = cdata;
+    for (n = 0; n < 6; n++)
+        cptr = ttcdt_huff_compress_ctx(ctx, udata + (n / 2) * 500, 2000 + (n % 2), cptr);
+
+    ptr = cdata;
+    for (n = 0; n < 6 && ptr != NULL; n++) {
+        ptr = ttcdt_huff_decompress_ctx(ctx, ptr, buf);
+
+        if (ptr == NULL || memcmp(buf, udata + (n / 2) * 500, 2000 + (n % 2)) != 0)
+            ok = 0;
+    }
+
+    do_test("Context: all blocks decompressed", ok);
+    do_test("Context: all input consumed", ptr == cptr);
+
+    ttcdt_huff_ctx_free(ctx);
+}
+
+
+void test_repeat(void)
+{
+    ttcdt_huff_ctx *ctx;
+    const unsigned char *ptr;
+    unsigned char *b2, *b3, *end;
+    int n, ok = 1;
+
+    ctx = ttcdt_huff_ctx_new(1, 0);
+    ttcdt_huff_ctx_repeat(ctx, 1);
+
+    /* two blocks of similar text */
+    b2 = ttcdt_huff_compress_ctx(ctx, udata, 8000, cdata);
+    b3 = ttcdt_huff_compress_ctx(ctx, udata + 2000, 4000, b2);
+
+    if (verbose)
+        printf("test: repeat -- first: %d, second: %d\n",
+            (int)(b2 - cdata), (int)(b3 - b2));
+
+    do_test("Repeat: first block has codes", !ttcdt_huff_repeats(cdata));
+    do_test("Repeat: second block repeats them", ttcdt_huff_repeats(b2));
+
+    /* a block of very different data doesn't */
+    memset(buf, 'x', 4000);
+    end = ttcdt_huff_compress_ctx(ctx, buf, 4000, b3);
+
+    do_test("Repeat: different block has codes", !ttcdt_huff_repeats(b3));
+
+    ttcdt_huff_ctx_free(ctx);
+
+    /* decompress them all */
+    ctx = ttcdt_huff_ctx_new(1, 0);
+
+    ptr = cdata;
+    for (n = 0; n < 3 && ptr != NULL; n++) {
+        ptr = ttcdt_huff_decompress_ctx(ctx, ptr, buf);
+
+        if (ptr == NULL || (n < 2 && memcmp(buf, udata + n * 2000, 8000 - n * 4000) != 0))
+            ok = 0;
+    }
+
+    do_test("Repeat: all blocks decompressed", ok && ptr == end);
+
+    ttcdt_huff_ctx_free(ctx);
+
+    /* a repeating block can't be decompressed on its own... */
+    do_test("Repeat: no codes, no decompression", ttcdt_huff_decompress(b2, buf) == NULL);
+
+    /* ...unless the codes are loaded first */
+    ctx = ttcdt_huff_ctx_new(1, 0);
+
+    do_test("Repeat: codes loaded", ttcdt_huff_ctx_load(ctx, cdata) == 0);
+
+    ptr = ttcdt_huff_decompress_ctx(ctx, b2, buf);
+
+    do_test("Repeat: decompression after loading",
+        ptr == b3 && memcmp(buf, udata + 2000, 4000) == 0);
+
+    ttcdt_huff_ctx_free(ctx);
+}
+
+
+void test_estimate(void)
+{
+    ttcdt_huff_ctx *ctx;
+    size_t sizes[] = { 0, 1, 300, 1024, 5000, 20000, 8000, 8001 };
+    unsigned char *rb;
+    size_t z = 2 * 1024 * 1024, n;
+    unsigned int r = 1;
+    int m, s, ok = 1;
+
+    /* the estimation matches the block, with and without
+       streams, and when codes are repeated */
+    for (s = 1; s <= 4; s += 3) {
+        ctx = ttcdt_huff_ctx_new(s, 0);
+        ttcdt_huff_ctx_repeat(ctx, 1);
+
+        for (m = 0; m < sizeof(sizes) / sizeof(sizes[0]); m++) {
+            size_t e = ttcdt_huff_estimate_ctx(ctx, udata + m, sizes[m]);
+            unsigned char *ptr = ttcdt_huff_compress_ctx(ctx, udata + m, sizes[m], cdata);
+
+            if (ptr - cdata != e)
+                ok = 0;
+        }
+
+        ttcdt_huff_ctx_free(ctx);
+    }
+
+    do_test("Estimated size is the compressed size", ok);
+
+    /* an empty block is just a header, and doesn't
+       break the codes repeated across it */
+    ctx = ttcdt_huff_ctx_new(1, 0);
+    ttcdt_huff_ctx_repeat(ctx, 1);
+
+    rb = ttcdt_huff_compress_z(udata, 0, cdata);
+    n  = rb - cdata;
+    ttcdt_huff_size_z(cdata, &z);
+
+    do_test("Empty block: header only", n == 5 && z == 0);
+    do_test("Empty block: decompression",
+        ttcdt_huff_decompress(cdata, buf) == rb &&
+        ttcdt_huff_decompress_safe(cdata, n, buf, 0) == 0);
+
+    rb = ttcdt_huff_compress_ctx(ctx, udata, 300, cdata);
+    rb = ttcdt_huff_compress_ctx(ctx, udata, 0, rb);
+    ttcdt_huff_compress_ctx(ctx, udata, 300, rb);
+    ttcdt_huff_ctx_free(ctx);
+
+    ctx = ttcdt_huff_ctx_new(1, 0);
+    rb  = (unsigned char *)ttcdt_huff_decompress_ctx(ctx, cdata, buf);
+    rb  = rb ? (unsigned char *)ttcdt_huff_decompress_ctx(ctx, rb, buf) : NULL;
+
+    do_test("Empty block: codes repeated across it",
+        ttcdt_huff_repeats(rb) && ttcdt_huff_decompress_ctx(ctx, rb, buf) != NULL &&
+        memcmp(buf, udata, 300) == 0);
+
+    ttcdt_huff_ctx_free(ctx);
+    z = 2 * 1024 * 1024;
+
+    /* the output doesn't depend on what a context did before */
+    ctx = ttcdt_huff_ctx_new(1, 0);
+    memset(buf, 0xff, 600);
+
+    ttcdt_huff_compress_ctx(ctx, buf, 600, cdata);
+    n = ttcdt_huff_compress_ctx(ctx, udata, 300, cdata) - cdata;
+    memset(cdata + n, '\0', 16);
+
+    ttcdt_huff_ctx_free(ctx);
+
+    do_test("Same output from any context",
+        ttcdt_huff_compress(udata, 300, cdata + n) - (cdata + n) == n &&
+        memcmp(cdata, cdata + n, n) == 0);
+
+    /* random data is not worth it, text is */
+    rb = malloc(z);
+
+    for (n = 0; n < z; n++) {
+        r = r * 1103515245 + 12345;
+        rb[n] = r >> 16;
+    }
+
+    do_test("Random data is not compressible", !ttcdt_huff_compressible(rb, z));
+
+    for (n = 0; n < z; n++)
+        rb[n] = udata[n % 8045];
+
+    do_test("Text is compressible", ttcdt_huff_compressible(rb, z));
+
+    free(rb);
+}
+
+
+void test_table(void)
+{
+    ttcdt_huff_table t, l;
+    size_t freqs[256], f[256];
+    unsigned char file[TTCDT_HUFF_TABLE_SIZE];
+    unsigned char *end;
+    const unsigned char *ptr;
+    int n, m, ok = 1;
+
+    /* train with the first half of the text... */
+    memset(freqs, '\0', sizeof(freqs));
+
+    for (n = 0; n < uz / 2; n += 200) {
+        ttcdt_huff_histogram(udata + n, 200, f);
+
+        for (m = 0; m < 256; m++)
+            freqs[m] += f[m];
+    }
+
+    ttcdt_huff_table_train(&t, freqs);
+
+    /* ...survive a trip through a table file... */
+    ttcdt_huff_table_save(&t, file);
+
+    do_test("Table: file loaded", ttcdt_huff_table_load(&l, file, sizeof(file)) == 0);
+    do_test("Table: same after loading", memcmp(&t, &l, sizeof(t)) == 0);
+
+    /* ...and compress small messages from the second half */
+    for (n = uz / 2; n + 200 <= uz; n += 200) {
+        end = ttcdt_huff_compress_table(&l, udata + n, 200, cdata);
+        ptr = ttcdt_huff_decompress_table(&l, cdata, buf);
+
+        if (ttcdt_huff_table_id(cdata) != t.id || ptr != end ||
+            memcmp(buf, udata + n, 200) != 0)
+            ok = 0;
+    }
+
+    do_test("Table: small messages", ok);
+
+    /* symbols never seen in training can be compressed, too */
+    for (n = 0; n < 256; n++)
+        buf[n] = n;
+
+    end = ttcdt_huff_compress_table(&t, buf, 256, cdata);
+    ptr = ttcdt_huff_decompress_table(&t, cdata, buf + 256);
+
+    do_test("Table: unseen symbols", ptr == end && memcmp(buf, buf + 256, 256) == 0);
+
+    /* without the table, blocks can't be decompressed */
+    do_test("Table: no table, no decompression", ttcdt_huff_decompress(cdata, buf) == NULL);
+
+    file[10] = 0;
+    do_test("Table: bad table file", ttcdt_huff_table_load(&l, file, sizeof(file)) == -1);
+
+    l.id++;
+    do_test("Table: other table rejected", ttcdt_huff_decompress_table(&l, cdata, buf) == NULL);
+
+    /* the generated table, trained with the same text */
+    end = ttcdt_huff_compress_table(&stress_table, udata, uz, cdata);
+    ptr = ttcdt_huff_decompress_table(&stress_table, cdata, buf);
+
+    do_test("Table: generated header", ptr == end && end - cdata < uz &&
+        memcmp(buf, udata, uz) == 0);
+}
+
+
+void test_seek(void)
+{
+    ttcdt_huff_ctx *ctx;
+    ttcdt_huff_seek *s;
+    unsigned char *ptr = cdata;
+    size_t n, z = 1000;
+    int m, ok = 1;
+
+    /* a seekable stream of blocks that repeat codes,
+       with a block stored uncompressed in the middle */
+    ctx = ttcdt_huff_ctx_new(1, 0);
+    ttcdt_huff_ctx_repeat(ctx, 1);
+    s = ttcdt_huff_seek_new();
+
+    memcpy(buf, udata, uz);
+    memset(buf + 5000, 'x', 1000);
+    for (n = 0; n < 1000; n++)
+        buf[12000 + n] = n * 7 + (n >> 3);
+
+    for (n = 0; n < 20000; n += z) {
+        unsigned char *p = ptr + 4;
+        int i;
+
+        if (n == 12000) {
+            /* not compressed */
+            ttcdt_huff_ctx_reset(ctx);
+            memcpy(p, buf + n, z);
+            i = -(int)z;
+            p += z;
+        }
+        else {
+            p = ttcdt_huff_compress_ctx(ctx, buf + n, z, p);
+            i = p - (ptr + 4);
+        }
+
+        for (m = 0; m < 4; m++)
+            ptr[m] = (unsigned int)i >> (m * 8);
+
+        ttcdt_huff_seek_add(s, ptr, p - ptr, z);
+        ptr = p;
+    }
+
+    ptr += ttcdt_huff_seek_index(s, ptr);
+
+    ttcdt_huff_seek_free(s);
+    ttcdt_huff_ctx_free(ctx);
+
+    /* ranges inside blocks, across them and whole ones */
+    for (n = 0; n < 20000; n += 777) {
+        size_t r = n % 3000 + 1;
+
+        if (n + r > 20000)
+            r = 20000 - n;
+
+        if (ttcdt_huff_decompress_range(cdata, ptr - cdata, n, r, buf + 100000) == -1 ||
+            memcmp(buf + n, buf + 100000, r) != 0)
+            ok = 0;
+    }
+
+    do_test("Seekable stream: ranges", ok);
+    do_test("Seekable stream: whole",
+        ttcdt_huff_decompress_range(cdata, ptr - cdata, 0, 20000, buf + 100000) == 0 &&
+        memcmp(buf, buf + 100000, 20000) == 0);
+    do_test("Seekable stream: out of range",
+        ttcdt_huff_decompress_range(cdata, ptr - cdata, 19999, 2, buf + 100000) == -1);
+}
+
+
+void test_stats(void)
+{
+    ttcdt_huff_ctx *ctx = ttcdt_huff_ctx_new(4, 0);
+    ttcdt_huff_stats s, r;
+    unsigned char *ptr;
+    int used[256], n, z = 0;
+
+    ttcdt_huff_ctx_stats(ctx, &s);
+    do_test("No stats before any block", s.uz == 0 && s.cz == 0);
+
+    memset(used, '\0', sizeof(used));
+
+    for (n = 0; n < uz; n++)
+        used[udata[n]] = 1;
+
+    for (n = 0; n < 256; n++)
+        z += used[n];
+
+    ptr = ttcdt_huff_compress_ctx(ctx, udata, uz, cdata);
+    ttcdt_huff_ctx_stats(ctx, &s);
+
+    do_test("Stats sizes", s.uz == uz && s.cz == ptr - cdata &&
+        s.hz > 5 && s.hz < s.cz);
+    do_test("Stats symbols", s.symbols == z && s.max_bits > 0 && s.max_bits <= 15);
+    do_test("Stats code length near the entropy",
+        s.entropy > 4.0 && s.bits >= s.entropy && s.bits < s.entropy + 1.0);
+
+    /* the same data again, repeating the codes */
+    ttcdt_huff_ctx_repeat(ctx, 1);
+    ttcdt_huff_compress_ctx(ctx, udata, uz, cdata);
+    ttcdt_huff_ctx_stats(ctx, &r);
+
+    do_test("Stats of a repeated block", r.repeated && r.hz < s.hz &&
+        r.bits == s.bits && r.cz == s.cz - (s.hz - r.hz));
+
+    ttcdt_huff_ctx_free(ctx);
+}
+
+
+/* set after the output, to catch writes past it */
+#define CANARY 0xa5
+int overrun = 0;
+
+int safe_dec(const unsigned char *ib, size_t iz)
+/* decompresses safely @ib into the first @uz bytes of buf */
+{
+    int ret;
+
+    buf[uz] = CANARY;
+    ret = ttcdt_huff_decompress_safe(ib, iz, buf, uz);
+
+    if (buf[uz] != CANARY)
+        overrun = 1;
+
+    return ret;
+}
+
+
+int safe_cut(const unsigned char *cb, size_t cz, size_t z)
+/* decompresses safely the first @z bytes of the @cz-byte block in @cb,
+   from a buffer of exactly that size */
+{
+    unsigned char *ib = malloc(z + 1);
+    int ret;
+
+    memcpy(ib, cb, z);
+    ret = safe_dec(ib, z);
+    free(ib);
+
+    return ret;
+}
+
+
+int safe_set(const unsigned char *cb, size_t cz, size_t o, int v, size_t n)
+/* decompresses safely the @cz-byte block in @cb, with
+   the @n bytes from offset @o set to @v */
+{
+    unsigned char *ib = malloc(cz);
+    int ret;
+
+    memcpy(ib, cb, cz);
+    memset(ib + o, v, n);
+    ret = safe_dec(ib, cz);
+    free(ib);
+
+    return ret;
+}
+
+
+void test_safe(void)
+{
+    const unsigned char *blocks[3];
+    size_t sizes[3], n, z;
+    unsigned int r = 1;
+    ttcdt_huff_ctx *ctx;
+    int m, ok, ret;
+
+    blocks[0] = cdata;
+    sizes[0]  = ttcdt_huff_compress_z(udata, uz, cdata) - cdata;
+    blocks[1] = cdata + sizes[0];
+    sizes[1]  = ttcdt_huff_compress_streams(udata, uz, cdata + sizes[0], 4) - blocks[1];
+    blocks[2] = v1_block;
+    sizes[2]  = sizeof(v1_block);
+
+    do_test("Safe: decompression", safe_cut(blocks[0], sizes[0], sizes[0]) == 0 &&
+        memcmp(buf, udata, uz) == 0);
+    do_test("Safe: decompression of streams",
+        safe_cut(blocks[1], sizes[1], sizes[1]) == 0 && memcmp(buf, udata, uz) == 0);
+    do_test("Safe: output too small",
+        ttcdt_huff_decompress_safe(cdata, sizes[0], buf, uz - 1) == TTCDT_HUFF_E_SPACE);
+
+    /* cut anywhere, they fail without reading past the end */
+    overrun = 0;
+
+    for (m = 0, ok = 1; m < 3; m++) {
+        for (n = 0; n < sizes[m]; n++) {
+            if (safe_cut(blocks[m], sizes[m], n) == 0)
+                ok = 0;
+        }
+    }
+
+    do_test("Safe: truncated blocks", ok && !overrun);
+    do_test("Safe: truncated error", safe_cut(blocks[0], sizes[0], sizes[0] - 1) ==
+        TTCDT_HUFF_E_TRUNCATED);
+
+    /* damage that can't be decoded: an unknown method, codes
+       repeated from no block and a size that never ends */
+    for (m = 0, ok = 1; m < 2; m++) {
+        if (safe_set(blocks[m], sizes[m], 3, 0x0e, 1) != TTCDT_HUFF_E_HEADER ||
+            safe_set(blocks[m], sizes[m], 3, blocks[m][3] | 0x20, 1) != TTCDT_HUFF_E_HEADER ||
+            safe_set(blocks[m], sizes[m], 4, 0xff, 11) != TTCDT_HUFF_E_HEADER)
+            ok = 0;
+    }
+
+    do_test("Safe: damaged blocks", ok && !overrun);
+
+    /* random damage may still decode (the blocks have no checksum),
+       but never reads nor writes out of the buffers */
+    for (n = 0, ok = 1; n < 2000; n++) {
+        unsigned char *ib = malloc(sizes[1]);
+
+        memcpy(ib, blocks[1], sizes[1]);
+
+        for (m = 0; m < 4; m++) {
+            r = r * 1103515245 + 12345;
+            ib[(r >> 8) % sizes[1]] ^= 1 << (r % 8);
+        }
+
+        ret = safe_dec(ib, sizes[1]);
+        free(ib);
+
+        if (ret > 0 || ret < TTCDT_HUFF_E_MEMORY)
+            ok = 0;
+    }
+
+    do_test("Safe: randomly damaged blocks", ok && !overrun);
+
+    /* the header calls, bounded as well */
+    do_test("Safe: size", ttcdt_huff_size_safe(blocks[0], sizes[0], &z) == 0 &&
+        z == uz);
+    do_test("Safe: size of a cut header",
+        ttcdt_huff_size_safe(blocks[0], 4, &z) == TTCDT_HUFF_E_TRUNCATED &&
+        z == (size_t)-1);
+    do_test("Safe: repeats of a cut header", !ttcdt_huff_repeats_safe(blocks[0], 3));
+
+    ctx = ttcdt_huff_ctx_new(1, 0);
+    do_test("Safe: codes loaded", ttcdt_huff_ctx_load_safe(ctx, blocks[0], sizes[0]) == 0);
+    do_test("Safe: codes of a cut block", ttcdt_huff_ctx_load_safe(ctx, blocks[0], 8) ==
+        TTCDT_HUFF_E_TRUNCATED);
+    ttcdt_huff_ctx_free(ctx);
+}
+
+
+void test_multi(void)
+{
+    size_t sizes[] = { 1, 2, 3, 65, 300, 1000, 1027, 4099, 20000 };
+    unsigned char *ub = malloc(20000);
+    unsigned int r = 1;
+    int n, m, s, ok = 1;
+
+    /* skewed data, with probabilities Huffman codes fit
+       exactly: most lookups decode several symbols */
+    for (n = 0; n < 20000; n++) {
+        r = r * 1103515245 + 12345;
+
+        for (m = 0; m < 5 && (r >> (16 + m)) & 1; m++);
+
+        ub[n] = 'a' + m;
+    }
+
+    for (s = 1; s <= 4; s += 3) {
+        for (m = 0; m < sizeof(sizes) / sizeof(sizes[0]); m++) {
+            size_t cz = ttcdt_huff_compress_streams(ub, sizes[m], cdata, s) - cdata;
+
+            memset(buf, '\0', sizes[m] + 16);
+
+            if (ttcdt_huff_decompress(cdata, buf) != cdata + cz ||
+                memcmp(ub, buf, sizes[m]) != 0 || buf[sizes[m]] != '\0' ||
+                ttcdt_huff_decompress_safe(cdata, cz, buf, sizes[m]) != 0 ||
+                memcmp(ub, buf, sizes[m]) != 0)
+                ok = 0;
+        }
+    }
+
+    do_test("Multi-symbol decoding", ok);
+
+    free(ub);
+}
+
+
+void test_ans(void)
+{
+    size_t sizes[] = { 2, 3, 17, 300, 1001, 4096, 20000 };
+    unsigned char *ub = malloc(20000);
+    unsigned char *ob = malloc(20000);
+    unsigned char *ib, *p[4];
+    ttcdt_huff_ctx *ctx = ttcdt_huff_ctx_new(1, 0);
+    ttcdt_huff_stats s;
+    unsigned int r = 1;
+    size_t n, cz, ez;
+    int m, ok = 1;
+
+    /* mostly one symbol: Huffman codes can't take less than a bit */
+    for (n = 0; n < 20000; n++) {
+        r = r * 1103515245 + 12345;
+        ub[n] = (r >> 16) % 16 ? 'a' : 'b' + (r >> 8) % 7;
+    }
+
+    for (m = 0; m < sizeof(sizes) / sizeof(sizes[0]); m++) {
+        ez = ttcdt_huff_estimate_ctx(ctx, ub, sizes[m]);
+        cz = ttcdt_huff_compress_ctx(ctx, ub, sizes[m], cdata) - cdata;
+
+        memset(ob, '\0', 20000);
+
+        if (ez != cz || ttcdt_huff_decompress(cdata, ob) != cdata + cz ||
+            memcmp(ub, ob, sizes[m]) != 0 || (sizes[m] < 20000 && ob[sizes[m]] != '\0') ||
+            ttcdt_huff_decompress_safe(cdata, cz, ob, sizes[m]) != 0 ||
+            memcmp(ub, ob, sizes[m]) != 0)
+            ok = 0;
+    }
+
+    do_test("tANS: round trips", ok);
+
+    ttcdt_huff_ctx_stats(ctx, &s);
+    do_test("tANS: used for very skewed data", s.ans && s.bits < 1.0 &&
+        s.bits >= s.entropy - 0.01 && s.bits < s.entropy + 0.05);
+
+    /* cut anywhere, or damaged, it fails without going out of the buffers */
+    for (n = 0; n < cz; n++) {
+        ib = malloc(n + 1);
+        memcpy(ib, cdata, n);
+
+        if (ttcdt_huff_decompress_safe(ib, n, ob, 20000) == 0)
+            ok = 0;
+
+        free(ib);
+    }
+
+    for (n = 0; n < 2000; n++) {
+        ib = malloc(cz);
+        memcpy(ib, cdata, cz);
+
+        r = r * 1103515245 + 12345;
+        ib[(r >> 8) % cz] ^= 1 << (r % 8);
+
+        ttcdt_huff_decompress_safe(ib, cz, ob, 20000);
+        free(ib);
+    }
+
+    do_test("tANS: truncated and damaged blocks", ok);
+
+    /* Huffman and tANS blocks mixed, with codes repeated where possible */
+    ttcdt_huff_ctx_repeat(ctx, 1);
+
+    p[0] = cdata;
+    p[1] = ttcdt_huff_compress_ctx(ctx, udata, uz, p[0]);
+    p[2] = ttcdt_huff_compress_ctx(ctx, ub, 20000, p[1]);
+    p[3] = ttcdt_huff_compress_ctx(ctx, udata, uz, p[2]);
+    ttcdt_huff_compress_ctx(ctx, udata, uz, p[3]);
+
+    do_test("tANS: no codes to repeat after a block",
+        !ttcdt_huff_repeats(p[2]) && ttcdt_huff_repeats(p[3]));
+
+    ttcdt_huff_ctx_free(ctx);
+    ctx = ttcdt_huff_ctx_new(1, 0);
+
+    ok = ttcdt_huff_decompress_ctx(ctx, p[0], buf) == p[1] && memcmp(buf, udata, uz) == 0 &&
+         ttcdt_huff_decompress_ctx(ctx, p[1], ob) == p[2] && memcmp(ob, ub, 20000) == 0 &&
+         ttcdt_huff_decompress_ctx(ctx, p[2], buf) == p[3] && memcmp(buf, udata, uz) == 0 &&
+         ttcdt_huff_decompress_ctx(ctx, p[3], buf) != NULL && memcmp(buf, udata, uz) == 0;
+
+    do_test("tANS: mixed blocks", ok);
+
+    ttcdt_huff_ctx_free(ctx);
+    free(ob);
+    free(ub);
 }
 
 
@@ -90,12 +823,70 @@ int main(int argc, char *argv[])
 
     test_1("carcosa.txt");
 
+    test_histogram();
+
+    test_large();
+
+    test_ctx();
+
+    test_repeat();
+
+    test_estimate();
+
+    test_table();
+
+    test_seek();
+
+    test_stats();
+
+    test_safe();
+
+    test_multi();
+
+    test_ans();
+
     for (n = 0; n < 20000; n++)
         udata[n] = 'A' + (n % ('Z' - 'A'));
     uz = 20000;
 
     test_1("Letter sequence");
 
+    /* Fibonacci frequencies make codes longer than any table */
+    {
+        int a = 1, b = 1, m;
+
+        for (n = uz = 0; n < 26; n++) {
+            for (m = 0; m < a; m++)
+                udata[uz++] = n;
+
+            m = a + b;
+            a = b;
+            b = m;
+        }
+    }
+
+    test_1("Fibonacci frequencies");
+
+    for (n = 0; n < 1000; n++)
+        udata[n] = 'x';
+    uz = 1000;
+
+    test_1("Single symbol");
+
+    {
+        unsigned int r = 1;
+
+        for (n = 0; n < 100000; n++) {
+            r = r * 1103515245 + 12345;
+            udata[n] = r >> 16;
+        }
+        uz = 100000;
+    }
+
+    test_1("Random bytes");
+
+    test_v1();
+
     printf("\n*** Total tests passed: %d/%d\n", oks, tests);
 
     if (oks == tests)
@@ -11,156 +11,1205 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "ttcdt-huff.h"
 
+#define CHUNK_SIZE (1024 * 1024)
+
 void usage(void)
 {
     printf("ttcdt-huff-ar - Extremely simple Huffman file archiver\n");
     printf("ttcdt <dev@triptico.com> -- public domain\n\n");
 
     printf("Usage:\n");
-    printf("  ttcdt-huff-ar c archive.aha [file(s)...]    Create archive\n");
-    printf("  ttcdt-huff-ar t archive.aha                 Test (list) archive\n");
+    printf("  ttcdt-huff-ar c [-b n] [-j n] archive.aha [file(s)...]    Create archive\n");
+    printf("  ttcdt-huff-ar t archive.aha [file(s)...]                  Test (list) archive\n");
+    printf("  ttcdt-huff-ar x [-j n] archive.aha [file(s)...]           Extract archive\n");
+    printf("\nOptions:\n");
+    printf("  -b n    Compress files in chunks of n KiB (default: %d)\n", CHUNK_SIZE / 1024);
+    printf("  -j n    Use n threads (default: all CPUs)\n");
 }
 
-int main(int argc, char *argv[])
+
+/*
+    Archive format:
+
+    "aha\0" signature, followed by a record per member:
+        name, '\0'-terminated
+        its chunks, each one:
+            int size (negative: stored uncompressed)
+            compressed block or uncompressed data
+
+    Then the central directory, an entry per member:
+        name, '\0'-terminated
+        8 bytes: offset of the member's first chunk
+        8 bytes: stored bytes (all chunks)
+        8 bytes: uncompressed size
+        8 bytes: checksum (FNV-1a of the uncompressed data)
+        1 byte: flags
+
+    Members with the same data as an earlier one have no record;
+    their entries point to the chunks of the first one.
+
+    And the trailer, always the last TRAILER_SIZE bytes:
+        8 bytes: offset of the central directory
+        8 bytes: number of entries
+        "ahd\0"
+
+    All directory and trailer numbers are little-endian.
+    Archives without trailer (version 1) are just the records,
+    with exactly one chunk per member.
+*/
+
+#define TRAILER_SIZE 20
+
+#define ENTRY_RAW 0x01      /* all chunks stored uncompressed */
+#define ENTRY_DUP 0x02      /* same data as an earlier entry */
+
+struct entry {
+    char *name;             /* file name */
+    uint64_t offset;        /* offset of the first chunk */
+    uint64_t csize;         /* stored bytes */
+    uint64_t usize;         /* uncompressed size */
+    uint64_t hash;          /* checksum */
+    int flags;              /* ENTRY_* flags */
+};
+
+
+uint64_t hash(const unsigned char *p, size_t z, uint64_t h)
+/* continues the FNV-1a hash @h over @z bytes of @p */
+{
+    while (z--)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+
+void put_le(FILE *o, uint64_t v, int n)
+/* writes @n bytes of @v, little-endian */
 {
+    while (n--) {
+        fputc(v & 0xff, o);
+        v >>= 8;
+    }
+}
+
+
+uint64_t get_le(const unsigned char *p, int n)
+/* reads @n bytes, little-endian */
+{
+    uint64_t v = 0;
+
+    while (n--)
+        v = (v << 8) | p[n];
+
+    return v;
+}
+
+
+void write_directory(FILE *o, const struct entry *e, int n)
+/* writes the central directory and the trailer */
+{
+    uint64_t d = ftell(o);
+    int m;
+
+    for (m = 0; m < n; m++) {
+        fwrite(e[m].name, strlen(e[m].name) + 1, 1, o);
+        put_le(o, e[m].offset, 8);
+        put_le(o, e[m].csize, 8);
+        put_le(o, e[m].usize, 8);
+        put_le(o, e[m].hash, 8);
+        fputc(e[m].flags, o);
+    }
+
+    put_le(o, d, 8);
+    put_le(o, n, 8);
+    fwrite("ahd", 4, 1, o);
+}
+
+
+struct entry *read_directory(FILE *i, int *n)
+/* reads the central directory. Returns NULL if there is none,
+   or it's corrupted (@n is then set to -1) */
+{
+    unsigned char t[TRAILER_SIZE];
+    unsigned char *d = NULL, *p;
+    struct entry *e = NULL;
+    uint64_t o, k;
+    long s;
+    int m;
+
+    *n = 0;
+
+    if (fseek(i, 0, SEEK_END) == -1 || (s = ftell(i)) < 4 + TRAILER_SIZE ||
+        fseek(i, s - TRAILER_SIZE, SEEK_SET) == -1 ||
+        fread(t, TRAILER_SIZE, 1, i) != 1 || memcmp(t + 16, "ahd", 4) != 0)
+        return NULL;
+
+    *n = -1;
+    o  = get_le(t, 8);
+    k  = get_le(t + 8, 8);
+
+    /* entries take at least 34 bytes, and they are counted in an int */
+    if (o < 4 || o > s - TRAILER_SIZE || k > (s - TRAILER_SIZE - o) / 34 ||
+        k >= INT_MAX)
+        return NULL;
+
+    /* one seek and one read */
+    s -= TRAILER_SIZE + o;
+    d = malloc(s + 1);
+    e = malloc((k + 1) * sizeof(struct entry));
+
+    if (d == NULL || e == NULL ||
+        fseek(i, o, SEEK_SET) == -1 || fread(d, 1, s, i) != s) {
+        free(e);
+        e = NULL;
+    }
+    else {
+        /* names end in the directory itself */
+        d[s] = '\0';
+
+        for (m = 0, p = d; m < (int)k; m++) {
+            size_t l = strlen((char *)p) + 1;
+
+            if (p + l + 33 > d + s)
+                break;
+
+            e[m].name = strdup((char *)p);
+            p += l;
+
+            e[m].offset = get_le(p, 8);
+            e[m].csize  = get_le(p + 8, 8);
+            e[m].usize  = get_le(p + 16, 8);
+            e[m].hash   = get_le(p + 24, 8);
+            e[m].flags  = p[32];
+            p += 33;
+        }
+
+        if (m < (int)k) {
+            while (m--)
+                free(e[m].name);
+
+            free(e);
+            e = NULL;
+        }
+        else
+            *n = (int)k;
+    }
+
+    free(d);
+
+    return e;
+}
+
+
+void free_directory(struct entry *e, int n)
+/* frees a directory */
+{
+    while (n-- > 0)
+        free(e[n].name);
+
+    free(e);
+}
+
+
+int selected(const char *name, int argc, char *argv[])
+/* returns non-zero if @name is among the file names in @argv
+   (or there are none) */
+{
+    int n;
+
+    for (n = 0; n < argc; n++) {
+        if (strcmp(name, argv[n]) == 0)
+            return 1;
+    }
+
+    return argc == 0;
+}
+
+
+/* compressed bytes of a member kept in memory until written;
+   the rest goes to a temporary file */
+#define SPILL_SIZE (4 * 1024 * 1024)
+
+/* why the compressed chunks of a member were lost */
+#define ERR_SPILL  1        /* they couldn't be spilled */
+#define ERR_MEMORY 2        /* no memory for them */
+
+struct member {
+    struct entry e;         /* directory entry */
+    int ok;                 /* the file could be read */
+    int dup;                /* earlier member with the same data, or -1 */
+    unsigned char *b;       /* compressed chunks */
+    size_t bz;              /* their size */
+    size_t ba;              /* allocated size of b */
+    FILE *spill;            /* the chunks that didn't fit in b */
+    int err;                /* the chunks were lost (ERR_*), or 0 */
+    int done;               /* compressed flag */
+};
+
+struct creation {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    int chunk;              /* chunk size */
+    char **argv;            /* files */
+    int argc;
+    struct member *r;       /* ring of members */
+    int rn;                 /* ring size */
+    int next;               /* next member to compress */
+    int written;            /* count of members written */
+    uint64_t *mh;           /* hash of each member */
+    uint64_t *mz;           /* size of each member */
+    int *ht;                /* first member by hash and size (-1: none) */
+    int hm;                 /* mask of ht size */
+};
+
+
+int find_member(struct creation *c, int n)
+/* registers member @n by its hash and size. Returns the first
+   member with the same ones (maybe @n itself). Must be called
+   with c->m locked */
+{
+    int s = c->mh[n] & c->hm;
+
+    for (;;) {
+        int i = c->ht[s];
+
+        if (i == -1 || i > n) {
+            /* members register out of order: keep the first */
+            if (i == -1 || (c->mh[i] == c->mh[n] && c->mz[i] == c->mz[n])) {
+                c->ht[s] = n;
+                return n;
+            }
+        }
+        else
+        if (c->mh[i] == c->mh[n] && c->mz[i] == c->mz[n])
+            return i;
+
+        s = (s + 1) & c->hm;
+    }
+}
+
+
+int same_file(const char *a, const char *b)
+/* returns non-zero if the files @a and @b have the same data */
+{
+    unsigned char ba[16384], bb[16384];
+    FILE *fa, *fb;
     int ret = 0;
 
-    if (argc < 3) {
-        usage();
-        ret = 1;
+    fa = fopen(a, "rb");
+    fb = fopen(b, "rb");
+
+    if (fa != NULL && fb != NULL) {
+        size_t za, zb;
+
+        do {
+            za = fread(ba, 1, sizeof(ba), fa);
+            zb = fread(bb, 1, sizeof(bb), fb);
+        } while (za == zb && za > 0 && memcmp(ba, bb, za) == 0);
+
+        ret = za == 0 && zb == 0;
+    }
+
+    if (fa != NULL)
+        fclose(fa);
+    if (fb != NULL)
+        fclose(fb);
+
+    return ret;
+}
+
+
+void emit(struct member *m, const void *p, size_t z)
+/* appends @z bytes of @p to the compressed chunks of @m */
+{
+    if (m->err)
+        return;
+
+    if (m->spill == NULL && m->bz + z <= SPILL_SIZE) {
+        if (m->bz + z > m->ba) {
+            /* grow it by doubling, up to the spill size */
+            size_t a = m->ba ? m->ba : 4096;
+            unsigned char *b;
+
+            while (a < m->bz + z)
+                a *= 2;
+
+            if (a > SPILL_SIZE)
+                a = SPILL_SIZE;
+
+            if ((b = realloc(m->b, a)) == NULL) {
+                m->err = ERR_MEMORY;
+                return;
+            }
+
+            m->b  = b;
+            m->ba = a;
+        }
+
+        memcpy(m->b + m->bz, p, z);
+        m->bz += z;
+    }
+    else {
+        if (m->spill == NULL && (m->spill = tmpfile()) == NULL)
+            m->err = ERR_SPILL;
+        else
+        if (fwrite(p, z, 1, m->spill) != 1)
+            m->err = ERR_SPILL;
+    }
+
+    m->e.csize += z;
+}
+
+
+void compress_chunk(ttcdt_huff_ctx *ctx, const unsigned char *ib, int z,
+                    unsigned char *ob, struct member *m)
+/* compresses a chunk of @z bytes into @m */
+{
+    int nz = z;
+
+    /* compressed size, if it looks worth it */
+    if (ttcdt_huff_compressible(ib, z))
+        nz = ttcdt_huff_estimate_ctx(ctx, ib, z);
+
+    if (nz < z) {
+        /* compressed */
+        m->e.flags &= ~ENTRY_RAW;
+
+        ttcdt_huff_compress_ctx(ctx, ib, z, ob);
+
+        emit(m, &nz, sizeof(nz));
+        emit(m, ob, nz);
     }
+    else {
+        /* uncompressed; the next chunk can't repeat codes */
+        ttcdt_huff_ctx_reset(ctx);
+
+        nz = -z;
+        emit(m, &nz, sizeof(nz));
+        emit(m, ib, z);
+    }
+}
+
+
+void compress_member(struct creation *c, ttcdt_huff_ctx *ctx,
+                     unsigned char *ib, unsigned char *ob, int n)
+/* reads and compresses file @n, in chunks, unless an earlier
+   member is known to have the same data */
+{
+    struct member *m = &c->r[n % c->rn];
+    FILE *i;
+    int z, d, big;
+
+    m->e.name  = c->argv[n];
+    m->e.csize = 0;
+    m->e.usize = 0;
+    m->e.hash  = HASH_INIT;
+    m->e.flags = ENTRY_RAW;
+    m->dup     = -1;
+    m->b       = NULL;
+    m->bz      = 0;
+    m->ba      = 0;
+    m->spill   = NULL;
+    m->err     = 0;
+
+    if ((i = fopen(c->argv[n], "rb")) == NULL) {
+        m->ok = 0;
+        return;
+    }
+
+    m->ok = 1;
+
+    if (ctx == NULL || ib == NULL || ob == NULL) {
+        /* no working space: it's registered as empty, so
+           it's lost unless it's a duplicate of an empty file */
+        m->err = ERR_MEMORY;
+        z = 0;
+    }
+    else {
+        /* the first chunk can't repeat codes */
+        ttcdt_huff_ctx_reset(ctx);
+
+        /* files that fit in a chunk stay in ib until they are known
+           not to be duplicates; bigger ones are hashed while they
+           are compressed, so they are only read once, and if they
+           turn out to be duplicates their chunks are dropped when
+           they are written */
+        z = fread(ib, 1, c->chunk, i);
+    }
+
+    big = z == c->chunk;
+
+    while (z > 0) {
+        m->e.usize += z;
+        m->e.hash   = hash(ib, z, m->e.hash);
+
+        if (!big)
+            break;
+
+        compress_chunk(ctx, ib, z, ob, m);
+        z = fread(ib, 1, c->chunk, i);
+    }
+
+    fclose(i);
+
+    pthread_mutex_lock(&c->m);
+    c->mh[n] = m->e.hash;
+    c->mz[n] = m->e.usize;
+    d = find_member(c, n);
+    pthread_mutex_unlock(&c->m);
+
+    if (d != n && same_file(c->argv[d], c->argv[n]))
+        m->dup = d;
     else
-    if (strcmp(argv[1], "c") == 0) {
-        FILE *o;
+    if (!big && m->e.usize)
+        compress_chunk(ctx, ib, m->e.usize, ob, m);
+}
+
+
+int write_member(FILE *o, struct creation *c, int n, unsigned char *buf,
+                 struct entry *e, int *k, int *ei)
+/* writes the record of compressed member @n, adding its entry
+   to the @k ones in @e, and its index to @ei. Returns -1 if
+   its compressed chunks were lost */
+{
+    struct member *m = &c->r[n % c->rn];
+    int d = m->dup;
 
-        if ((o = fopen(argv[2], "wb")) != NULL) {
-            int n;
+    ei[n] = -1;
 
-            /* write signature */
-            fwrite("aha", 4, 1, o);
+    if (!m->ok) {
+        printf("WARN : cannot open '%s'\n", m->e.name);
+        return 0;
+    }
 
-            for (n = 3; n < argc; n++) {
-                struct stat s;
-                FILE *i;
+    /* if the first member with the same data registered after
+       this one was compressed, it's found now: the archive is
+       the same whatever the order the workers ran in */
+    if (d == -1) {
+        pthread_mutex_lock(&c->m);
+        d = find_member(c, n);
+        pthread_mutex_unlock(&c->m);
 
-                if ((i = fopen(argv[n], "rb")) != NULL && fstat(fileno(i), &s) != -1) {
-                    unsigned char *ib, *ob, *ptr;
-                    int z = s.st_size, nz;
+        if (d == n || !same_file(c->argv[d], c->argv[n]))
+            d = -1;
+    }
 
-                    /* alloc working size */
-                    ib = malloc(z);
-                    ob = malloc(z * 3);
+    /* the first one was lost: the archive is, too */
+    if (d != -1 && ei[d] == -1)
+        d = -1;
 
-                    /* read and compress in one chunk */
-                    fread(ib, z, 1, i);
-                    ptr = ttcdt_huff_compress(ib, z, ob);
+    /* the chunks of duplicates are dropped, lost or not */
+    if (d == -1 && m->err) {
+        if (m->err == ERR_MEMORY)
+            printf("ERROR: out of memory for '%s'\n", m->e.name);
+        else
+            printf("ERROR: cannot write a temporary file for '%s'\n", m->e.name);
 
-                    /* compressed size */
-                    nz = ptr - ob;
+        if (m->spill != NULL)
+            fclose(m->spill);
 
-                    /* write file name */
-                    fwrite(argv[n], strlen(argv[n]) + 1, 1, o);
+        free(m->b);
 
-                    if (nz < z) {
-                        /* compressed */
+        return -1;
+    }
 
-                        /* write size */
-                        fwrite(&nz, sizeof(nz), 1, o);
+    ei[n] = *k;
 
-                        /* write compressed stream */
-                        fwrite(ob, nz, 1, o);
-                    }
-                    else {
-                        /* uncompressed */
+    if (d != -1) {
+        /* a reference to the data of the first one */
+        e[*k] = e[ei[d]];
+        e[*k].name   = m->e.name;
+        e[*k].flags |= ENTRY_DUP;
+    }
+    else {
+        /* write file name */
+        fwrite(m->e.name, strlen(m->e.name) + 1, 1, o);
 
-                        /* write size */
-                        nz = -z;
-                        fwrite(&nz, sizeof(nz), 1, o);
+        e[*k] = m->e;
+        e[*k].offset = ftell(o);
 
-                        /* write uncompressed stream */
-                        fwrite(ib, z, 1, o);
-                    }
+        if (m->bz)
+            fwrite(m->b, m->bz, 1, o);
 
-                    free(ib);
-                    free(ob);
+        if (m->spill != NULL) {
+            size_t z;
 
-                    fclose(i);
-                }
-                else
-                    printf("WARN : cannot open '%s'\n", argv[n]);
-            }
+            rewind(m->spill);
 
-            fclose(o);
+            while ((z = fread(buf, 1, c->chunk, m->spill)) > 0)
+                fwrite(buf, z, 1, o);
         }
-        else {
-            printf("ERROR: cannot create '%s'\n", argv[2]);
-            ret = 3;
+    }
+
+    if (m->spill != NULL)
+        fclose(m->spill);
+
+    free(m->b);
+
+    (*k)++;
+
+    return 0;
+}
+
+
+void *create_worker(void *arg)
+/* compresses members until there are no more */
+{
+    struct creation *c = arg;
+    ttcdt_huff_ctx *ctx = ttcdt_huff_ctx_new(1, 0);
+    unsigned char *ib = malloc(c->chunk);
+    unsigned char *ob = malloc(c->chunk);
+    int n;
+
+    /* without them, the members it takes are lost */
+    if (ctx != NULL)
+        ttcdt_huff_ctx_repeat(ctx, 1);
+
+    for (;;) {
+        /* wait for a free slot in the ring */
+        pthread_mutex_lock(&c->m);
+
+        while (c->next < c->argc && c->next >= c->written + c->rn)
+            pthread_cond_wait(&c->c, &c->m);
+
+        n = c->next++;
+        pthread_mutex_unlock(&c->m);
+
+        if (n >= c->argc)
+            break;
+
+        compress_member(c, ctx, ib, ob, n);
+
+        pthread_mutex_lock(&c->m);
+        c->r[n % c->rn].done = 1;
+        pthread_cond_broadcast(&c->c);
+        pthread_mutex_unlock(&c->m);
+    }
+
+    free(ob);
+    free(ib);
+    ttcdt_huff_ctx_free(ctx);
+
+    return NULL;
+}
+
+
+int create(const char *archive, int chunk, int threads, int argc, char *argv[])
+/* creates an archive. Members are compressed by @threads threads
+   and written in order, so the archive is always the same */
+{
+    struct creation c;
+    struct entry *e;
+    ttcdt_huff_ctx *ctx = NULL;
+    unsigned char *buf, *ib = NULL, *ob = NULL;
+    pthread_t *t;
+    FILE *o;
+    int *ei;
+    int n, k = 0, ret = 0;
+
+    if ((o = fopen(archive, "wb")) == NULL) {
+        printf("ERROR: cannot create '%s'\n", archive);
+        return 3;
+    }
+
+    /* the working space doesn't depend on the size of the files */
+    e   = malloc((argc + 1) * sizeof(struct entry));
+    ei  = malloc((argc + 1) * sizeof(int));
+    buf = malloc(chunk);
+
+    pthread_mutex_init(&c.m, NULL);
+    pthread_cond_init(&c.c, NULL);
+    c.chunk   = chunk;
+    c.argv    = argv;
+    c.argc    = argc;
+    c.rn      = threads * 2;
+    c.r       = malloc(c.rn * sizeof(struct member));
+    c.next    = 0;
+    c.written = 0;
+    c.mh      = malloc((argc + 1) * sizeof(uint64_t));
+    c.mz      = malloc((argc + 1) * sizeof(uint64_t));
+
+    /* hash table at most half full */
+    for (c.hm = 1; c.hm < argc * 2; c.hm <<= 1);
+    c.ht = malloc(c.hm * sizeof(int));
+
+    t = malloc(threads * sizeof(pthread_t));
+
+    if (e == NULL || ei == NULL || buf == NULL || c.r == NULL ||
+        c.mh == NULL || c.mz == NULL || c.ht == NULL || t == NULL) {
+        printf("ERROR: out of memory\n");
+
+        free(t);
+        free(c.ht);
+        free(c.mz);
+        free(c.mh);
+        free(c.r);
+        pthread_cond_destroy(&c.c);
+        pthread_mutex_destroy(&c.m);
+        free(buf);
+        free(ei);
+        free(e);
+        fclose(o);
+        remove(archive);
+
+        return 5;
+    }
+
+    for (n = 0; n < c.hm; n++)
+        c.ht[n] = -1;
+
+    c.hm--;
+
+    for (n = 0; n < c.rn; n++)
+        c.r[n].done = 0;
+
+    if (threads > 1) {
+        for (n = 0; n < threads; n++)
+            pthread_create(&t[n], NULL, create_worker, &c);
+    }
+    else {
+        /* working space to do it all in this thread */
+        ctx = ttcdt_huff_ctx_new(1, 0);
+        ib  = malloc(chunk);
+        ob  = malloc(chunk);
+
+        if (ctx != NULL)
+            ttcdt_huff_ctx_repeat(ctx, 1);
+    }
+
+    /* write signature */
+    fwrite("aha", 4, 1, o);
+
+    /* this thread is the writer */
+    for (n = 0; n < argc; n++) {
+        struct member *m = &c.r[n % c.rn];
+
+        if (threads > 1) {
+            pthread_mutex_lock(&c.m);
+
+            while (!m->done)
+                pthread_cond_wait(&c.c, &c.m);
+
+            pthread_mutex_unlock(&c.m);
         }
+        else
+            compress_member(&c, ctx, ib, ob, n);
+
+        /* keep the workers going, but the archive is lost */
+        if (write_member(o, &c, n, buf, e, &k, ei) == -1)
+            ret = 5;
+
+        pthread_mutex_lock(&c.m);
+        m->done = 0;
+        c.written++;
+        pthread_cond_broadcast(&c.c);
+        pthread_mutex_unlock(&c.m);
     }
+
+    if (threads > 1) {
+        for (n = 0; n < threads; n++)
+            pthread_join(t[n], NULL);
+    }
+    else {
+        free(ob);
+        free(ib);
+
+        if (ctx != NULL)
+            ttcdt_huff_ctx_free(ctx);
+    }
+
+    write_directory(o, e, k);
+
+    free(t);
+    free(c.ht);
+    free(c.mz);
+    free(c.mh);
+    free(c.r);
+    pthread_cond_destroy(&c.c);
+    pthread_mutex_destroy(&c.m);
+    free(buf);
+    free(ei);
+    free(e);
+    fclose(o);
+
+    if (ret)
+        remove(archive);
+
+    return ret;
+}
+
+
+void print_entry(const char *name, uint64_t csize, uint64_t usize, int flags)
+/* prints an archive member */
+{
+    printf("%s", name);
+
+    if (flags & ENTRY_RAW)
+        printf(" %llu (uncompressed)\n", (unsigned long long)usize);
     else
-    if (strcmp(argv[1], "t") == 0) {
-        FILE *i;
+        printf(" %llu %llu (%.2f%%)\n", (unsigned long long)csize,
+            (unsigned long long)usize,
+            100.0 * ((double)usize - (double)csize) / (double)usize);
+}
 
-        if ((i = fopen(argv[2], "rb")) != NULL) {
-            char buf[5];
 
-            buf[4] = '\0';
+int list_v1(FILE *i, int argc, char *argv[])
+/* lists an archive without directory, reading it all */
+{
+    char name[4096];
+    int c, z, l;
 
-            /* read signature */
-            fread(buf, 4, 1, i);
+    fseek(i, 4, SEEK_SET);
 
-            if (strcmp("aha", buf) == 0) {
-                /* print file name */
-                int c, z;
+    while (!feof(i)) {
+        for (l = 0; (c = fgetc(i)) != EOF && c != '\0'; l++) {
+            if (l < sizeof(name) - 1)
+                name[l] = c;
+        }
 
-                while (!feof(i)) {
-                    while ((c = fgetc(i)) != EOF && c != '\0')
-                        printf("%c", c);
-    
-                    if (c == EOF)
-                        break;
+        if (c == EOF)
+            break;
+
+        name[l < sizeof(name) ? l : sizeof(name) - 1] = '\0';
+
+        /* read file size */
+        fread(&z, sizeof(z), 1, i);
+
+        if (z <= 0) {
+            /* uncompressed */
+            if (selected(name, argc, argv))
+                print_entry(name, -z, -z, ENTRY_RAW);
+
+            fseek(i, -z, SEEK_CUR);
+        }
+        else {
+            /* compressed */
+            unsigned char *ib = malloc(z);
+            size_t rz, uz;
 
-                    /* read file size */
-                    fread(&z, sizeof(z), 1, i);
-    
-                    if (z < 0) {
-                        /* uncompressed */
-                        printf(" %d (uncompressed)\n", -z);
-    
-                        fseek(i, -z, SEEK_CUR);
-                    }
-                    else {
-                        /* compressed */
-                        unsigned char *ib = malloc(z);
-                        int uz;
-    
-                        /* read compressed file */
-                        fread(ib, z, 1, i);
-    
-                        /* get uncompressed size */
-                        ttcdt_huff_size(ib, &uz);
-    
-                        printf(" %d %d (%.2f%%)\n", z, uz,
-                            100.0 * ((float)uz - (float)z) / (float)uz);
-                    }
+            /* read compressed file */
+            rz = fread(ib, 1, z, i);
+
+            /* get uncompressed size */
+            ttcdt_huff_size_safe(ib, rz, &uz);
+
+            if (selected(name, argc, argv))
+                print_entry(name, z, uz, 0);
+
+            free(ib);
+        }
+    }
+
+    return 0;
+}
+
+
+int list(const char *archive, int argc, char *argv[])
+/* lists an archive */
+{
+    struct entry *e;
+    char buf[4];
+    FILE *i;
+    int n, ret = 0;
+
+    if ((i = fopen(archive, "rb")) == NULL) {
+        printf("ERROR: cannot open '%s'\n", archive);
+        return 3;
+    }
+
+    /* read signature */
+    if (fread(buf, 4, 1, i) != 1 || memcmp("aha", buf, 4) != 0) {
+        printf("ERROR: '%s' not a .aha archive\n", archive);
+        ret = 4;
+    }
+    else
+    if ((e = read_directory(i, &n)) != NULL) {
+        int m;
+
+        for (m = 0; m < n; m++) {
+            if (!selected(e[m].name, argc, argv))
+                continue;
+
+            if (e[m].flags & ENTRY_DUP) {
+                int d;
+
+                /* the entry that really has the data */
+                for (d = 0; d < m; d++) {
+                    if (e[d].offset == e[m].offset && !(e[d].flags & ENTRY_DUP))
+                        break;
                 }
+
+                printf("%s %llu (same as '%s')\n", e[m].name,
+                    (unsigned long long)e[m].usize, d < m ? e[d].name : "?");
             }
-            else {
-                printf("ERROR: '%s' not a .aha archive\n", argv[2]);
-                ret = 4;
-            }
+            else
+                print_entry(e[m].name, e[m].csize, e[m].usize, e[m].flags);
+        }
+
+        free_directory(e, n);
+    }
+    else
+    if (n == 0)
+        ret = list_v1(i, argc, argv);
+    else {
+        printf("ERROR: '%s' has a corrupted directory\n", archive);
+        ret = 4;
+    }
+
+    fclose(i);
+
+    return ret;
+}
+
+
+struct entry *scan_v1(const unsigned char *map, size_t size, int *n)
+/* builds the entries of an archive without directory from its
+   mapping. Returns NULL if it's corrupted */
+{
+    struct entry *e = NULL;
+    size_t o = 4;
+    int k = 0;
+
+    while (o < size) {
+        const unsigned char *p = memchr(map + o, '\0', size - o);
+        int z;
+
+        if (p == NULL || (size_t)(p + 1 - map) + sizeof(z) > size)
+            break;
+
+        memcpy(&z, p + 1, sizeof(z));
+
+        e = realloc(e, (k + 1) * sizeof(struct entry));
+
+        e[k].name   = strdup((char *)map + o);
+        e[k].offset = p + 1 - map;
+        e[k].csize  = sizeof(z) + (z < 0 ? -(int64_t)z : z);
+        e[k].hash   = 0;
+        e[k].flags  = z <= 0 ? ENTRY_RAW : 0;
+        e[k].usize  = z < 0 ? -(int64_t)z : 0;
+        k++;
+
+        o = e[k - 1].offset + e[k - 1].csize;
+
+        if (o > size)
+            break;
+
+        if (z > 0) {
+            size_t uz;
+
+            ttcdt_huff_size_safe(p + 1 + sizeof(z), z, &uz);
+            e[k - 1].usize = uz;
+        }
+    }
+
+    *n = k;
+
+    if (o != size) {
+        free_directory(e, k);
+        e = NULL;
+    }
+
+    return e;
+}
+
+
+int make_dirs(const char *path)
+/* creates the directories in @path */
+{
+    char *p = strdup(path);
+    char *s;
+    int ret = 0;
+
+    for (s = strchr(p + 1, '/'); s != NULL; s = strchr(s + 1, '/')) {
+        *s = '\0';
+
+        if (mkdir(p, 0755) == -1 && errno != EEXIST)
+            ret = -1;
+
+        *s = '/';
+    }
+
+    free(p);
+
+    return ret;
+}
+
+
+struct extraction {
+    pthread_mutex_t m;
+    const unsigned char *map;   /* archive mapping */
+    size_t size;                /* its size */
+    struct entry *e;            /* entries */
+    int n;                      /* number of entries */
+    int next;                   /* next entry to extract */
+    int check;                  /* entries have checksums */
+    int argc;                   /* selected members */
+    char **argv;
+    int errors;                 /* count of failed members */
+};
+
+
+int extract_chunks(ttcdt_huff_ctx *ctx, const unsigned char *p, size_t z,
+                   unsigned char *ob, uint64_t uz)
+/* decompresses the @z bytes of chunks in @p into the @uz bytes of @ob.
+   Returns -1 if they are corrupted */
+{
+    const unsigned char *e = p + z;
+    uint64_t w = 0;
+
+    /* a member's first chunk has codes of its own */
+    ttcdt_huff_ctx_reset(ctx);
+
+    while (p < e) {
+        int64_t cz;
+        int i;
+
+        if (e - p < sizeof(i))
+            return -1;
+
+        memcpy(&i, p, sizeof(i));
+        p += sizeof(i);
+        cz = i;
+
+        if (cz <= 0) {
+            /* uncompressed */
+            if (-cz > e - p || -cz > uz - w)
+                return -1;
+
+            memcpy(ob + w, p, -cz);
+            w += -cz;
+            p += -cz;
+        }
+        else {
+            size_t bz;
+
+            /* compressed */
+            if (cz > e - p)
+                return -1;
+
+            if (ttcdt_huff_decompress_safe_ctx(ctx, p, cz, ob + w, uz - w) != 0)
+                return -1;
+
+            ttcdt_huff_size_safe(p, cz, &bz);
+
+            w += bz;
+            p += cz;
+        }
+    }
+
+    return w == uz ? 0 : -1;
+}
+
+
+int extract_entry(struct extraction *x, ttcdt_huff_ctx *ctx, const struct entry *e)
+/* extracts a member directly from the archive mapping into
+   the mapping of the destination file. Returns -1 on errors */
+{
+    const char *path = e->name;
+    unsigned char *ob = NULL;
+    int fd, ret = -1;
+
+    /* always extract under the current directory */
+    while (*path == '/')
+        path++;
+
+    if (*path == '\0' || strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0 ||
+        strstr(path, "/../") != NULL ||
+        (strlen(path) >= 3 && strcmp(path + strlen(path) - 3, "/..") == 0)) {
+        printf("WARN : skipping unsafe name '%s'\n", e->name);
+        return -1;
+    }
+
+    if (e->offset > x->size || e->csize > x->size - e->offset) {
+        printf("ERROR: '%s' is corrupted\n", e->name);
+        return -1;
+    }
+
+    make_dirs(path);
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+        printf("ERROR: cannot create '%s'\n", path);
+        return -1;
+    }
+
+    if (e->usize && (ftruncate(fd, e->usize) == -1 ||
+        (ob = mmap(NULL, e->usize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+        printf("ERROR: cannot write '%s'\n", path);
+        close(fd);
+        return -1;
+    }
+
+    ret = extract_chunks(ctx, x->map + e->offset, e->csize, ob, e->usize);
+
+    if (ret == 0 && x->check && hash(ob, e->usize, HASH_INIT) != e->hash)
+        ret = -1;
+
+    if (ret == -1)
+        printf("ERROR: '%s' is corrupted\n", e->name);
+
+    if (ob != NULL)
+        munmap(ob, e->usize);
+
+    close(fd);
+
+    return ret;
+}
+
+
+void *extract_worker(void *arg)
+/* extracts members until there are no more */
+{
+    struct extraction *x = arg;
+    ttcdt_huff_ctx *ctx = ttcdt_huff_ctx_new(1, 0);
+
+    for (;;) {
+        int n;
+
+        pthread_mutex_lock(&x->m);
+        n = x->next++;
+        pthread_mutex_unlock(&x->m);
+
+        if (n >= x->n)
+            break;
+
+        if (selected(x->e[n].name, x->argc, x->argv) &&
+            extract_entry(x, ctx, &x->e[n]) == -1) {
+            pthread_mutex_lock(&x->m);
+            x->errors++;
+            pthread_mutex_unlock(&x->m);
+        }
+    }
+
+    ttcdt_huff_ctx_free(ctx);
+
+    return NULL;
+}
+
+
+int extract(const char *archive, int threads, int argc, char *argv[])
+/* extracts an archive */
+{
+    struct extraction x;
+    struct stat s;
+    pthread_t *t;
+    FILE *i;
+    int n, ret = 0;
+
+    if ((i = fopen(archive, "rb")) == NULL || fstat(fileno(i), &s) == -1) {
+        printf("ERROR: cannot open '%s'\n", archive);
+        return 3;
+    }
+
+    x.size = s.st_size;
+    x.map  = x.size ? mmap(NULL, x.size, PROT_READ, MAP_SHARED, fileno(i), 0) : MAP_FAILED;
+
+    if (x.map == MAP_FAILED || x.size < 4 || memcmp("aha", x.map, 4) != 0) {
+        printf("ERROR: '%s' not a .aha archive\n", archive);
+        ret = 4;
+    }
+    else {
+        x.check = 1;
+
+        if ((x.e = read_directory(i, &x.n)) == NULL && x.n == 0) {
+            /* no directory: find the records */
+            x.e = scan_v1(x.map, x.size, &x.n);
+            x.check = 0;
+        }
+
+        if (x.e == NULL) {
+            printf("ERROR: '%s' is corrupted\n", archive);
+            ret = 4;
         }
         else {
-            printf("ERROR: cannot open '%s'\n", argv[2]);
-            ret = 3;
+            pthread_mutex_init(&x.m, NULL);
+            x.next   = 0;
+            x.argc   = argc;
+            x.argv   = argv;
+            x.errors = 0;
+
+            /* the calling thread is one of the workers */
+            if (threads > x.n)
+                threads = x.n;
+
+            t = malloc(threads * sizeof(pthread_t));
+
+            for (n = 1; n < threads; n++)
+                pthread_create(&t[n], NULL, extract_worker, &x);
+
+            extract_worker(&x);
+
+            for (n = 1; n < threads; n++)
+                pthread_join(t[n], NULL);
+
+            free(t);
+            pthread_mutex_destroy(&x.m);
+            free_directory(x.e, x.n);
+
+            if (x.errors)
+                ret = 5;
         }
     }
+
+    if (x.map != MAP_FAILED)
+        munmap((void *)x.map, x.size);
+
+    fclose(i);
+
+    return ret;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int chunk = CHUNK_SIZE;
+    int ret = 0;
+    int n = 2;
+
+    /* options, after the command */
+    while (n + 1 < argc && argv[n][0] == '-') {
+        if (strcmp(argv[n], "-j") == 0)
+            threads = atoi(argv[n + 1]);
+        else
+        if (strcmp(argv[n], "-b") == 0)
+            chunk = atoi(argv[n + 1]) * 1024;
+        else
+            break;
+
+        n += 2;
+    }
+
+    if (threads < 1)
+        threads = 1;
+
+    if (argc < 3 || n >= argc || argv[n][0] == '-' ||
+        chunk < 1024 || chunk > 1024 * 1024 * 1024) {
+        usage();
+        ret = 1;
+    }
+    else
+    if (strcmp(argv[1], "c") == 0)
+        ret = create(argv[n], chunk, threads, argc - n - 1, argv + n + 1);
+    else
+    if (strcmp(argv[1], "t") == 0)
+        ret = list(argv[n], argc - n - 1, argv + n + 1);
+    else
+    if (strcmp(argv[1], "x") == 0)
+        ret = extract(argv[n], threads, argc - n - 1, argv + n + 1);
     else {
         usage();
         ret = 2;
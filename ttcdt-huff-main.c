@@ -11,6 +11,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "ttcdt-huff.h"
 
@@ -20,75 +27,686 @@ void usage(void)
     printf("ttcdt <dev@triptico.com>\n\n");
 
     printf("Usage:\n");
-    printf("  ttcdt-huff -C               Compress STDIN to STDOUT\n");
-    printf("  ttcdt-huff -D               Decompress STDIN to STDOUT\n");
+    printf("  ttcdt-huff -C [-T n] [-S]   Compress STDIN to STDOUT\n");
+    printf("  ttcdt-huff -D [-T n]        Decompress STDIN to STDOUT\n");
+    printf("  ttcdt-huff -R from,size     Decompress part of a seekable STDIN\n");
+    printf("\nOptions:\n");
+    printf("  -T n                        Use n coding threads (default: 1)\n");
+    printf("  -S                          Make it seekable (add a block index)\n");
 }
 
 
 #define CHUNK_SIZE 16384
+#define STREAMS 4
 
-int compress(FILE *i, FILE *o)
+/* block sizes are 4-byte little-endian signed integers */
+#define SIZE_BYTES 4
+
+struct block {
+    unsigned char bi[CHUNK_SIZE];       /* input */
+    unsigned char bo[SIZE_BYTES + CHUNK_SIZE]; /* output */
+    unsigned char br[CHUNK_SIZE];       /* block whose codes bi repeats */
+    const unsigned char *pi;            /* input (bi or the mapped file) */
+    const unsigned char *pr;            /* br or the mapped file */
+    unsigned char *po;                  /* output (bo or the mapped file) */
+    int iz;                             /* input size */
+    int oz;                             /* output size (-1: corrupted) */
+    int rz;                             /* size of br (0: none) */
+    int done;                           /* processed flag */
+};
+
+
+struct io {
+    FILE *i;                            /* input file */
+    const unsigned char *ib;            /* input mapping (NULL: use stdio) */
+    size_t iz;                          /* size of ib */
+    size_t ip;                          /* read position in ib */
+    unsigned char *ob;                  /* output mapping (NULL: use stdio) */
+    size_t oz;                          /* size of ob */
+    size_t op;                          /* write position in ob */
+};
+
+
+const unsigned char *map_input(FILE *i, size_t *z, int advice)
+/* maps the rest of @i from its current position if
+   it's a regular file, to be read as @advice says */
 {
-    int ret = 0;
-    int z;
-    unsigned char bi[CHUNK_SIZE];
-    unsigned char bo[CHUNK_SIZE * 2];
+    const unsigned char *ib = NULL;
+    struct stat s;
+    off_t o, a;
+
+    if (fstat(fileno(i), &s) != -1 && S_ISREG(s.st_mode) &&
+        (o = lseek(fileno(i), 0, SEEK_CUR)) != -1 && s.st_size > o) {
+        /* mappings start at a page boundary */
+        a  = o - o % sysconf(_SC_PAGESIZE);
+        *z = s.st_size - o;
+        ib = mmap(NULL, s.st_size - a, PROT_READ, MAP_SHARED, fileno(i), a);
+
+        if (ib == MAP_FAILED)
+            ib = NULL;
+        else {
+            madvise((void *)ib, s.st_size - a, advice);
+            ib += o - a;
+        }
+    }
+
+    return ib;
+}
+
+
+void unmap_input(const unsigned char *ib, size_t z)
+/* unmaps the @z bytes mapped by map_input() */
+{
+    size_t a = (uintptr_t)ib % sysconf(_SC_PAGESIZE);
+
+    munmap((void *)(ib - a), z + a);
+}
 
-    while ((z = fread(bi, 1, CHUNK_SIZE, i))) {
-        unsigned char *ptr;
-        int cz;
 
-        ptr = ttcdt_huff_compress(bi, z, bo);
-        cz = ptr - bo;
+unsigned char *map_output(FILE *o, size_t z)
+/* sizes the regular file @o to @z bytes and maps it */
+{
+    unsigned char *ob = NULL;
+    struct stat s;
+    char fn[64];
+    int fd;
+
+    /* only if it's new and not appended to; a redirected
+       stdout is write-only, so it's opened again to map it */
+    if (z > 0 && fstat(fileno(o), &s) != -1 && S_ISREG(s.st_mode) &&
+        s.st_size == 0 && !(fcntl(fileno(o), F_GETFL) & O_APPEND)) {
+        sprintf(fn, "/proc/self/fd/%d", fileno(o));
 
-        if (cz >= z) {
-            /* non-compressed block */
-            z = -z;
-            fwrite(&z, sizeof(z), 1, o);
-            fwrite(bi, 1, -z, o);
+        if ((fd = open(fn, O_RDWR)) != -1) {
+            if (ftruncate(fd, z) != -1) {
+                ob = mmap(NULL, z, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+                if (ob == MAP_FAILED) {
+                    ob = NULL;
+                    ftruncate(fd, 0);
+                }
+            }
+
+            close(fd);
         }
-        else {
-            fwrite(&cz, sizeof(cz), 1, o);
-            fwrite(bo, 1, cz, o);
+    }
+
+    return ob;
+}
+
+
+int read_chunk(struct io *io, struct block *b)
+/* reads a chunk of uncompressed data */
+{
+    if (io->ib != NULL) {
+        /* point to it in place */
+        b->iz = io->iz - io->ip < CHUNK_SIZE ? io->iz - io->ip : CHUNK_SIZE;
+        b->pi = io->ib + io->ip;
+        io->ip += b->iz;
+    }
+    else {
+        b->iz = fread(b->bi, 1, CHUNK_SIZE, io->i);
+        b->pi = b->bi;
+    }
+
+    b->po = b->bo;
+
+    return b->iz ? 1 : 0;
+}
+
+
+void put_size(unsigned char *p, int z)
+/* stores the block size @z into @p */
+{
+    uint32_t v = z;
+    int n;
+
+    for (n = 0; n < SIZE_BYTES; n++)
+        p[n] = v >> (n * 8);
+}
+
+
+int get_size(const unsigned char *p)
+/* returns the block size stored in @p */
+{
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+    return (int32_t)v;
+}
+
+
+void pack(ttcdt_huff_ctx *ctx, struct block *b)
+/* compresses a chunk, prefixed by its size */
+{
+    int z;
+
+    z = ttcdt_huff_estimate_ctx(ctx, b->pi, b->iz);
+
+    if (z < b->iz)
+        ttcdt_huff_compress_ctx(ctx, b->pi, b->iz, b->bo + SIZE_BYTES);
+    else {
+        /* non-compressed block; the next one can't repeat its codes */
+        ttcdt_huff_ctx_reset(ctx);
+
+        z = b->iz;
+        memcpy(b->bo + SIZE_BYTES, b->pi, z);
+        z = -z;
+    }
+
+    put_size(b->bo, z);
+    b->oz = SIZE_BYTES + (z < 0 ? -z : z);
+}
+
+
+int stream_size(const unsigned char *ib, size_t iz, size_t *uz)
+/* adds up the uncompressed size of the blocks
+   in @ib. Returns -1 if they are corrupted */
+{
+    size_t p = 0;
+
+    *uz = 0;
+
+    while (iz - p >= SIZE_BYTES) {
+        int z, bz;
+
+        z  = get_size(ib + p);
+        p += SIZE_BYTES;
+
+        if (z == 0)
+            break;
+
+        if (z > CHUNK_SIZE || z < -CHUNK_SIZE)
+            return -1;
+
+        bz = z < 0 ? -z : z;
+
+        if (bz > iz - p)
+            return -1;
+
+        if (z > 0) {
+            size_t cz;
+
+            if (ttcdt_huff_size_safe(ib + p, bz, &cz) != 0 || cz > CHUNK_SIZE)
+                return -1;
+
+            z = (int)cz;
         }
+        else
+            z = bz;
+
+        *uz += z;
+        p += bz;
     }
 
-    return ret;
+    return 0;
 }
 
 
-int decompress(FILE *i, FILE *o)
+/* last block with codes of its own */
+unsigned char last[CHUNK_SIZE];
+const unsigned char *last_p = last;
+int last_z = 0;
+
+int read_block(struct io *io, struct block *b)
+/* reads a compressed block. Returns -1 if it's corrupted */
 {
-    int ret = 0;
+    unsigned char s[SIZE_BYTES];
     int z;
-    unsigned char bi[CHUNK_SIZE];
-    unsigned char bo[CHUNK_SIZE];
-
-    while (fread(&z, sizeof(z), 1, i)) {
-        if (z < 0) {
-            /* non-compressed block */
-            fread(bi, 1, -z, i);
-            fwrite(bi, 1, -z, o);
+
+    if (io->ib != NULL) {
+        if (io->iz - io->ip < SIZE_BYTES)
+            return 0;
+
+        z = get_size(io->ib + io->ip);
+        io->ip += SIZE_BYTES;
+    }
+    else {
+        if (!fread(s, SIZE_BYTES, 1, io->i))
+            return 0;
+
+        z = get_size(s);
+    }
+
+    /* a zero size ends the blocks of a seekable stream */
+    if (z == 0)
+        return 0;
+
+    if (z > CHUNK_SIZE || z < -CHUNK_SIZE)
+        return -1;
+
+    b->iz = z;
+    b->rz = 0;
+
+    if (z < 0)
+        z = -z;
+
+    if (io->ib != NULL) {
+        if (z > io->iz - io->ip)
+            return -1;
+
+        b->pi = io->ib + io->ip;
+        io->ip += z;
+    }
+    else {
+        if (fread(b->bi, 1, z, io->i) != z)
+            return -1;
+
+        b->pi = b->bi;
+    }
+
+    if (b->iz > 0) {
+        if (ttcdt_huff_repeats_safe(b->pi, z)) {
+            /* attach the block with the codes, as this one
+               may be decompressed by another thread */
+            b->rz = last_z;
+
+            if (io->ib != NULL)
+                b->pr = last_p;
+            else {
+                memcpy(b->br, last, last_z);
+                b->pr = b->br;
+            }
         }
         else {
-            int dz;
+            last_z = z;
+
+            if (io->ib != NULL)
+                last_p = b->pi;
+            else
+                memcpy(last, b->pi, z);
+        }
+    }
+
+    if (io->ob != NULL) {
+        /* decompress it in place, already sized by stream_size() */
+        if (b->iz > 0) {
+            size_t cz;
+
+            if (ttcdt_huff_size_safe(b->pi, z, &cz) != 0 || cz > CHUNK_SIZE)
+                return -1;
+
+            z = (int)cz;
+        }
+
+        b->po = io->ob + io->op;
+        io->op += z;
+    }
+    else
+        b->po = b->bo;
+
+    return 1;
+}
+
+
+void unpack(ttcdt_huff_ctx *ctx, struct block *b)
+/* decompresses a block */
+{
+    if (b->iz < 0) {
+        /* non-compressed block */
+        b->oz = -b->iz;
+        memcpy(b->po, b->pi, b->oz);
+    }
+    else {
+        size_t z;
+
+        if (ttcdt_huff_size_safe(b->pi, b->iz, &z) != 0 || z > CHUNK_SIZE ||
+            (b->rz && ttcdt_huff_ctx_load_safe(ctx, b->pr, b->rz) != 0) ||
+            ttcdt_huff_decompress_safe_ctx(ctx, b->pi, b->iz, b->po, z) != 0)
+            b->oz = -1;
+        else
+            b->oz = (int)z;
+    }
+}
+
+
+struct pool {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    struct block *b;                /* ring of blocks */
+    int n;                          /* size of the ring */
+    int queued;                     /* blocks read */
+    int taken;                      /* blocks taken by the workers */
+    int written;                    /* blocks written */
+    int end;                        /* no more blocks will be read */
+    int repeat;                     /* blocks can repeat codes */
+    int r;                          /* reader status */
+    int w;                          /* writer status */
+    void (*job)(ttcdt_huff_ctx *, struct block *);  /* work on each block */
+    struct io *io;                  /* input and mappings */
+    FILE *o;                        /* output */
+    ttcdt_huff_seek *s;             /* index (can be NULL) */
+};
+
+
+void *worker(void *arg)
+/* processes blocks from the pool until there are no more */
+{
+    struct pool *p = arg;
+    ttcdt_huff_ctx *ctx = ttcdt_huff_ctx_new(STREAMS, 0);
+
+    pthread_mutex_lock(&p->m);
+
+    if (ctx == NULL) {
+        /* stop everything */
+        p->w = -2;
+        p->end = 1;
+        pthread_cond_broadcast(&p->c);
+        pthread_mutex_unlock(&p->m);
+
+        return NULL;
+    }
+
+    /* a single worker takes the blocks in sequence */
+    ttcdt_huff_ctx_repeat(ctx, p->repeat);
+
+    for (;;) {
+        struct block *b;
+
+        while (p->taken == p->queued && !p->end)
+            pthread_cond_wait(&p->c, &p->m);
+
+        if (p->taken == p->queued)
+            break;
+
+        b = &p->b[p->taken++ % p->n];
+
+        pthread_mutex_unlock(&p->m);
+        p->job(ctx, b);
+        pthread_mutex_lock(&p->m);
+
+        b->done = 1;
+        pthread_cond_broadcast(&p->c);
+    }
+
+    pthread_mutex_unlock(&p->m);
+
+    ttcdt_huff_ctx_free(ctx);
+
+    return NULL;
+}
+
+
+void *writer(void *arg)
+/* writes the blocks from the pool in the original order */
+{
+    struct pool *p = arg;
+
+    pthread_mutex_lock(&p->m);
+
+    for (;;) {
+        struct block *b;
+        int r = 0;
+
+        while (p->written == p->queued && !p->end)
+            pthread_cond_wait(&p->c, &p->m);
+
+        if (p->written == p->queued)
+            break;
+
+        b = &p->b[p->written % p->n];
+
+        /* if a worker failed, the block may never be done */
+        while (!b->done && !p->w)
+            pthread_cond_wait(&p->c, &p->m);
+
+        if (!b->done)
+            break;
+
+        if (b->oz == -1)
+            r = -1;
+        else {
+            pthread_mutex_unlock(&p->m);
+
+            if (p->io->ob == NULL)
+                fwrite(b->bo, 1, b->oz, p->o);
+
+            if (p->s != NULL && ttcdt_huff_seek_add(p->s, b->bo, b->oz, b->iz) == -1)
+                r = -2;
+
+            pthread_mutex_lock(&p->m);
+        }
+
+        if (r) {
+            /* stop everything */
+            p->w = r;
+            p->end = 1;
+            pthread_cond_broadcast(&p->c);
+            break;
+        }
+
+        p->written++;
+        pthread_cond_broadcast(&p->c);
+    }
+
+    pthread_mutex_unlock(&p->m);
+
+    return NULL;
+}
+
+
+int run(struct io *io, FILE *o, int threads, int (*rd)(struct io *, struct block *),
+        void (*job)(ttcdt_huff_ctx *, struct block *), ttcdt_huff_seek *s)
+/* reads blocks with @rd, processes them with @job in
+   @threads threads and writes them in the original order
+   (unless they are already in the output mapping),
+   adding them to the index @s if it's not NULL. Reading,
+   processing and writing run in their own threads */
+{
+    int ret = 0;
+    int n, r;
+    struct pool p;
+    pthread_t *t, tw;
+
+    if (threads < 1)
+        threads = 1;
+
+    /* two blocks per worker keep them all busy, plus
+       the one being read (so one worker is triple buffered) */
+    p.n      = threads * 2 + 1;
+    p.b      = malloc(p.n * sizeof(struct block));
+    p.queued = p.taken = p.written = p.end = 0;
+    p.repeat = threads == 1;
+    p.r      = p.w = 0;
+    p.job    = job;
+    p.io     = io;
+    p.o      = o;
+    p.s      = s;
+    t        = malloc(threads * sizeof(pthread_t));
+
+    pthread_mutex_init(&p.m, NULL);
+    pthread_cond_init(&p.c, NULL);
 
-            fread(bi, 1, z, i);
+    if (p.b == NULL || t == NULL)
+        p.w = -2;
+    else {
+        for (n = 0; n < threads; n++)
+            pthread_create(&t[n], NULL, worker, &p);
+
+        pthread_create(&tw, NULL, writer, &p);
+
+        pthread_mutex_lock(&p.m);
+
+        /* this is the reader */
+        for (;;) {
+            struct block *b;
 
-            ttcdt_huff_size(bi, &dz);
+            while (!p.end && p.queued - p.written == p.n)
+                pthread_cond_wait(&p.c, &p.m);
 
-            if (dz > CHUNK_SIZE) {
-                fprintf(stderr, "ttcdt-huff: error: corrupted stream\n");
-                ret = 4;
+            if (p.end)
                 break;
+
+            b = &p.b[p.queued % p.n];
+
+            pthread_mutex_unlock(&p.m);
+            r = rd(io, b);
+            pthread_mutex_lock(&p.m);
+
+            if (r == 1) {
+                b->done = 0;
+                p.queued++;
+            }
+            else {
+                p.r = r;
+                p.end = 1;
             }
 
-            ttcdt_huff_decompress(bi, bo);
+            pthread_cond_broadcast(&p.c);
+        }
+
+        pthread_mutex_unlock(&p.m);
+
+        for (n = 0; n < threads; n++)
+            pthread_join(t[n], NULL);
+
+        pthread_join(tw, NULL);
+    }
+
+    r = p.w ? p.w : p.r;
+
+    if (r == -1) {
+        fprintf(stderr, "ttcdt-huff: error: corrupted stream\n");
+        ret = 4;
+    }
+    else
+    if (r == -2) {
+        fprintf(stderr, "ttcdt-huff: error: out of memory\n");
+        ret = 5;
+    }
+
+    pthread_mutex_destroy(&p.m);
+    pthread_cond_destroy(&p.c);
+    free(t);
+    free(p.b);
+
+    return ret;
+}
+
+
+int compress(FILE *i, FILE *o, int threads, int seekable)
+{
+    ttcdt_huff_seek *s = NULL;
+    struct io io;
+    int ret;
+
+    if (seekable && (s = ttcdt_huff_seek_new()) == NULL) {
+        fprintf(stderr, "ttcdt-huff: error: out of memory\n");
+        return 5;
+    }
+
+    memset(&io, 0, sizeof(io));
+    io.i  = i;
+    io.ib = map_input(i, &io.iz, MADV_SEQUENTIAL);
+
+    ret = run(&io, o, threads, read_chunk, pack, s);
+
+    if (s != NULL) {
+        /* append the index */
+        size_t z = ttcdt_huff_seek_index(s, NULL);
+        unsigned char *x = malloc(z);
 
-            fwrite(bo, 1, dz, o);
+        if (ret == 0) {
+            if (x == NULL) {
+                fprintf(stderr, "ttcdt-huff: error: out of memory\n");
+                ret = 5;
+            }
+            else {
+                ttcdt_huff_seek_index(s, x);
+                fwrite(x, 1, z, o);
+            }
         }
+
+        free(x);
+        ttcdt_huff_seek_free(s);
+    }
+
+    if (io.ib != NULL)
+        unmap_input(io.ib, io.iz);
+
+    return ret;
+}
+
+
+int decompress(FILE *i, FILE *o, int threads)
+{
+    struct io io;
+    int ret;
+
+    memset(&io, 0, sizeof(io));
+    io.i  = i;
+    io.ib = map_input(i, &io.iz, MADV_SEQUENTIAL);
+
+    /* with both files mapped, blocks are decompressed in place */
+    if (io.ib != NULL && stream_size(io.ib, io.iz, &io.oz) == 0)
+        io.ob = map_output(o, io.oz);
+
+    ret = run(&io, o, threads, read_block, unpack, NULL);
+
+    if (io.ob != NULL)
+        munmap(io.ob, io.oz);
+
+    if (io.ib != NULL)
+        unmap_input(io.ib, io.iz);
+
+    return ret;
+}
+
+
+int decompress_range(FILE *i, FILE *o, uint64_t from, size_t z)
+/* decompresses @z bytes from @from, reading only the blocks needed */
+{
+    unsigned char *ib, *ob;
+    size_t iz = 0;
+    int ret = 0;
+    int mapped;
+
+    /* if mapped, only the pages of the wanted blocks are read */
+    ib = (unsigned char *)map_input(i, &iz, MADV_RANDOM);
+    mapped = ib != NULL;
+
+    if (!mapped) {
+        /* pipes must be read whole */
+        size_t a = 0, r;
+
+        do {
+            if (iz == a) {
+                unsigned char *p = realloc(ib, a ? a * 2 : CHUNK_SIZE);
+
+                if (p == NULL) {
+                    fprintf(stderr, "ttcdt-huff: error: out of memory\n");
+                    free(ib);
+
+                    return 5;
+                }
+
+                ib = p;
+                a  = a ? a * 2 : CHUNK_SIZE;
+            }
+
+            r = fread(ib + iz, 1, a - iz, i);
+            iz += r;
+        } while (r > 0);
+    }
+
+    if ((ob = malloc(z + 1)) == NULL) {
+        fprintf(stderr, "ttcdt-huff: error: out of memory\n");
+        ret = 5;
+    }
+    else
+    if (ttcdt_huff_decompress_range(ib, iz, from, z, ob) == 0)
+        fwrite(ob, 1, z, o);
+    else {
+        fprintf(stderr, "ttcdt-huff: error: corrupted stream or bad range\n");
+        ret = 4;
     }
 
+    free(ob);
+
+    if (mapped)
+        unmap_input(ib, iz);
+    else
+        free(ib);
+
     return ret;
 }
 
@@ -96,18 +714,46 @@ int decompress(FILE *i, FILE *o)
 int main(int argc, char *argv[])
 {
     int ret = 0;
+    int mode = 0;
+    int threads = 1;
+    int seekable = 0;
+    unsigned long long from = 0, size = 0;
+    int n;
+
+    for (n = 1; n < argc; n++) {
+        if (strcmp(argv[n], "-C") == 0 || strcmp(argv[n], "-D") == 0)
+            mode = argv[n][1];
+        else
+        if (strcmp(argv[n], "-T") == 0 && n + 1 < argc)
+            threads = atoi(argv[++n]);
+        else
+        if (strcmp(argv[n], "-S") == 0)
+            seekable = 1;
+        else
+        if (strcmp(argv[n], "-R") == 0 && n + 1 < argc &&
+            sscanf(argv[++n], "%llu,%llu", &from, &size) == 2)
+            mode = 'R';
+        else {
+            mode = 0;
+            break;
+        }
+    }
 
     if (argc == 1) {
         usage();
         ret = 1;
     }
     else
-    if (strcmp(argv[1], "-C") == 0) {
-        ret = compress(stdin, stdout);
+    if (mode == 'C') {
+        ret = compress(stdin, stdout, threads, seekable);
+    }
+    else
+    if (mode == 'D') {
+        ret = decompress(stdin, stdout, threads);
     }
     else
-    if (strcmp(argv[1], "-D") == 0) {
-        ret = decompress(stdin, stdout);
+    if (mode == 'R') {
+        ret = decompress_range(stdin, stdout, from, size);
     }
     else {
         usage();
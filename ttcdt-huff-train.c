@@ -0,0 +1,195 @@
+/*
+
+    ttcdt-huff-train - Static code table builder.
+
+    ttcdt <dev@triptico.com>
+
+    This software is released into the public domain.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "ttcdt-huff.h"
+
+void usage(void)
+{
+    printf("ttcdt-huff-train - Static code table builder\n");
+    printf("ttcdt <dev@triptico.com> -- public domain\n\n");
+
+    printf("Usage:\n");
+    printf("  ttcdt-huff-train t table.aht [file(s) or dir(s)...]   Train table\n");
+    printf("  ttcdt-huff-train h table.aht name                    Table as C header\n");
+}
+
+
+/* symbol frequencies of all the corpus */
+size_t freqs[256];
+
+int count_file(const char *fn)
+/* adds the frequencies of a file. Returns -1 if it cannot be read */
+{
+    FILE *i;
+    struct stat s;
+    int ret = -1;
+
+    if ((i = fopen(fn, "rb")) != NULL && fstat(fileno(i), &s) != -1) {
+        size_t f[256];
+        unsigned char *ib;
+        size_t z = s.st_size;
+        int n;
+
+        if ((ib = malloc(z + 1)) != NULL && fread(ib, 1, z, i) == z) {
+            ttcdt_huff_histogram(ib, z, f);
+
+            for (n = 0; n < 256; n++)
+                freqs[n] += f[n];
+
+            ret = 0;
+        }
+
+        free(ib);
+    }
+
+    if (i != NULL)
+        fclose(i);
+
+    return ret;
+}
+
+
+int count(const char *fn)
+/* adds the frequencies of a file, or of all files in a directory */
+{
+    struct stat s;
+    DIR *d;
+
+    if (stat(fn, &s) == -1)
+        return -1;
+
+    if (!S_ISDIR(s.st_mode))
+        return count_file(fn);
+
+    if ((d = opendir(fn)) != NULL) {
+        struct dirent *e;
+
+        while ((e = readdir(d)) != NULL) {
+            char *p;
+
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+                continue;
+
+            p = malloc(strlen(fn) + strlen(e->d_name) + 2);
+            sprintf(p, "%s/%s", fn, e->d_name);
+
+            if (count(p) == -1)
+                printf("WARN : cannot read '%s'\n", p);
+
+            free(p);
+        }
+
+        closedir(d);
+    }
+
+    return d != NULL ? 0 : -1;
+}
+
+
+void header(const ttcdt_huff_table *t, const char *name)
+/* prints @t as a C header */
+{
+    int n;
+
+    printf("/* static Huffman table, generated by ttcdt-huff-train */\n\n");
+    printf("#include \"ttcdt-huff.h\"\n\n");
+    printf("static const ttcdt_huff_table %s = {\n", name);
+    printf("    0x%08lxUL,\n", (unsigned long)t->id);
+
+    printf("    {");
+    for (n = 0; n < 256; n++)
+        printf("%s%d%s", n % 16 ? " " : "\n        ", t->n_bits[n], n < 255 ? "," : "");
+    printf("\n    },\n");
+
+    printf("    {");
+    for (n = 0; n < 256; n++)
+        printf("%s0x%03lx%s", n % 8 ? " " : "\n        ", (unsigned long)t->codes[n],
+            n < 255 ? "," : "");
+    printf("\n    },\n");
+
+    printf("    {");
+    for (n = 0; n < 1 << TTCDT_HUFF_TABLE_BITS; n++)
+        printf("%s0x%04x%s", n % 8 ? " " : "\n        ", t->dec[n],
+            n < (1 << TTCDT_HUFF_TABLE_BITS) - 1 ? "," : "");
+    printf("\n    }\n");
+
+    printf("};\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+
+    if (argc < 3) {
+        usage();
+        ret = 1;
+    }
+    else
+    if (strcmp(argv[1], "t") == 0) {
+        ttcdt_huff_table t;
+        unsigned char buf[TTCDT_HUFF_TABLE_SIZE];
+        FILE *o;
+        int n;
+
+        for (n = 3; n < argc; n++) {
+            if (count(argv[n]) == -1)
+                printf("WARN : cannot read '%s'\n", argv[n]);
+        }
+
+        ttcdt_huff_table_train(&t, freqs);
+        ttcdt_huff_table_save(&t, buf);
+
+        if ((o = fopen(argv[2], "wb")) != NULL) {
+            fwrite(buf, sizeof(buf), 1, o);
+            fclose(o);
+        }
+        else {
+            printf("ERROR: cannot create '%s'\n", argv[2]);
+            ret = 3;
+        }
+    }
+    else
+    if (strcmp(argv[1], "h") == 0 && argc > 3) {
+        ttcdt_huff_table t;
+        unsigned char buf[TTCDT_HUFF_TABLE_SIZE + 1];
+        FILE *i;
+
+        if ((i = fopen(argv[2], "rb")) != NULL) {
+            size_t z = fread(buf, 1, sizeof(buf), i);
+
+            if (ttcdt_huff_table_load(&t, buf, z) == 0)
+                header(&t, argv[3]);
+            else {
+                printf("ERROR: '%s' not a table file\n", argv[2]);
+                ret = 4;
+            }
+
+            fclose(i);
+        }
+        else {
+            printf("ERROR: cannot open '%s'\n", argv[2]);
+            ret = 3;
+        }
+    }
+    else {
+        usage();
+        ret = 2;
+    }
+
+    return ret;
+}
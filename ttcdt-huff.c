@@ -15,6 +15,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+
+#ifdef TTCDT_HUFF_TRACE
+#include <time.h>
+#endif
 
 #include "ttcdt-huff.h"
 
@@ -27,6 +34,136 @@ struct node {
 
 #define NUM_NODES 512
 
+/* longest code that can be stored in an int */
+#define MAX_CODE 31
+
+/* longest code the encoder produces */
+#ifndef TTCDT_HUFF_MAX_BITS
+#define TTCDT_HUFF_MAX_BITS 15
+#endif
+
+/* bits resolved by the first-level decoding table */
+#define TABLE_BITS 11
+
+/* maximum number of interleaved streams */
+#define MAX_STREAMS 15
+
+/* bytes counted by each round of the histogram tables */
+#define HIST_SEGMENT (1 << 30)
+
+/* longest block header, codes and stream sizes can be */
+#define SAFE_HEADER 2048
+
+/* minimum number of symbols per interleaved stream */
+#define STREAM_MIN 256
+
+/* data size from where ttcdt_huff_compressible() samples it */
+#define SAMPLE_MIN (1 << 20)
+
+/* pieces of data sampled, and their size */
+#define SAMPLE_SLICES 16
+#define SAMPLE_SLICE 4096
+
+/* room for the second-level decoding tables */
+#define SUB_SIZE 4096
+
+/* most symbols decoded by a multi-symbol table lookup */
+#define MULTI_MAX 3
+
+/* average code length (in bits) up to where
+   multi-symbol tables are worth building */
+#define MULTI_BITS 8
+
+/* biggest and smallest tANS tables, as log2 of their states */
+#define ANS_LOG 11
+#define ANS_MIN_LOG 5
+
+struct entry {
+    unsigned short v;   /* symbol, or offset of the subtable */
+    unsigned char n;    /* code length (0: not in the tables) */
+    unsigned char s;    /* subtable bits (0: this is a symbol) */
+};
+
+struct multi {
+    unsigned char v[MULTI_MAX]; /* symbols */
+    unsigned char k;    /* how many (0: use the entries) */
+    unsigned char n;    /* bits they take */
+};
+
+struct table {
+    int single;                 /* the only symbol (0-bit code), or -1 */
+    int max_bits;               /* longest code */
+    int n_long;                 /* count of symbols not in the tables */
+    unsigned char longs[256];   /* symbols not in the tables */
+    int n_bits[256];            /* code lengths */
+    uint32_t codes[256];        /* codes, as read from the stream */
+    struct entry e[(1 << TABLE_BITS) + SUB_SIZE];
+    int multi;                  /* m is in use */
+    struct multi *m;            /* multi-symbol table (NULL: none) */
+};
+
+struct ans_entry {
+    unsigned short x;   /* base of the next state */
+    unsigned char s;    /* symbol */
+    unsigned char n;    /* bits to read for the next state */
+};
+
+struct ans_sym {
+    uint32_t dn;        /* added to a state, gives the bits to write above bit 16 */
+    int ds;             /* added to the shifted state, gives its index in st */
+};
+
+struct ans_enc {
+    int log;                    /* log2 of the number of states */
+    struct ans_sym s[256];      /* symbol transforms */
+    unsigned short st[1 << ANS_LOG];    /* next states */
+};
+
+struct ans_dec {
+    int log;                    /* log2 of the number of states */
+    struct ans_entry d[1 << ANS_LOG];   /* decoding table */
+};
+
+struct plan {
+    const unsigned char *ib;    /* data the plan is for */
+    size_t uz;                  /* its size */
+    int mode;                   /* block mode */
+    int streams;                /* streams to write */
+    size_t freqs[256];          /* frequency of symbols */
+    size_t (*s_freqs)[256];     /* the same, by stream (NULL: one stream) */
+    int z;                      /* number of used symbols */
+    int n_bits[256];            /* new code lengths */
+    unsigned char syms[256];    /* new used symbols */
+    unsigned char lb[512];      /* compressed code lengths */
+    size_t lz;                  /* size of lb */
+    size_t sz;                  /* size of the block */
+    int a_log;                  /* log2 of the number of tANS states */
+    int a_norm[256];            /* normalized frequencies (sum: 1 << a_log) */
+    struct ans_enc *a;          /* tANS coding tables (NULL: not allocated yet) */
+    unsigned char ab[1024];     /* compressed normalized frequencies */
+    size_t az;                  /* size of ab */
+    uint64_t a_bits;            /* size of the tANS stream, in bits */
+};
+
+struct ttcdt_huff_ctx {
+    int streams;                /* interleaved streams per block */
+    int max_bits;               /* longest code to produce */
+    int repeat;                 /* codes can be repeated between blocks */
+    int p_ok;                   /* p holds a plan to compress */
+    struct plan *p;             /* compression plan */
+    int c_ok;                   /* the codes below are valid */
+    int z;                      /* number of used symbols */
+    int n_bits[256];            /* code lengths */
+    uint32_t codes[256];        /* codes, as written to the stream */
+    unsigned char syms[256];    /* used symbols */
+    int t_ok;                   /* t holds a valid decoding table */
+    struct table *t;            /* decoding table */
+    struct ans_dec *a;          /* tANS decoding table */
+#ifdef TTCDT_HUFF_TRACE
+    uint64_t t0;                /* start of the phase being traced */
+#endif
+};
+
 
 /** utility functions **/
 
@@ -77,165 +214,362 @@ static const unsigned char *read_bits(const unsigned char *ib,
 }
 
 
+static uint32_t reverse_bits(uint32_t v, int count)
+/* reverses the order of the lower @count bits of @v */
+{
+    uint32_t r = 0;
+
+    while (count--) {
+        r = (r << 1) | (v & 0x1);
+        v >>= 1;
+    }
+
+    return r;
+}
+
+
 /** compression **/
 
-static int insert_node(int i, int *z, int f, int l, int r, int c, struct node *tree)
-/* inserts a node, sorted by frequency */
+void ttcdt_huff_histogram(const unsigned char *ib, size_t uz, size_t *freqs)
+/* counts the frequency of each byte in @ib into @freqs */
 {
-    int n, p;
+    /* consecutive equal bytes would increment the same counter,
+       each increment waiting for the previous one to be stored;
+       spreading them over several tables avoids that */
+    uint32_t c[4][256];
+    int n;
 
-    /* loop until a value with a higher frequency is found */
-    for (n = i, p = -1; n != -1 && tree[n].f < f; p = n, n = tree[n].n);
+    memset(freqs, '\0', sizeof(size_t) * 256);
 
-    /* insert in that position */
-    if (p != -1)
-        tree[p].n = *z;
-    else
-        i = *z;
+    while (uz) {
+        /* segments small enough for the 32-bit counters */
+        size_t z = uz > HIST_SEGMENT ? HIST_SEGMENT : uz;
+        const unsigned char *e = ib + (z & ~(size_t)7);
+
+        memset(c, '\0', sizeof(c));
+        uz -= z;
 
-    tree[*z].n    = n;
-    tree[*z].f    = f;
-    tree[*z].b[0] = l;
-    tree[*z].b[1] = r;
-    tree[*z].c    = c;
+        /* read 8 bytes at a time */
+        for (; ib < e; ib += 8) {
+            uint64_t w;
 
-    *z = *z + 1;
+            memcpy(&w, ib, sizeof(w));
 
-    return i;
+            c[0][w & 0xff]++;
+            c[1][(w >> 8) & 0xff]++;
+            c[2][(w >> 16) & 0xff]++;
+            c[3][(w >> 24) & 0xff]++;
+            c[0][(w >> 32) & 0xff]++;
+            c[1][(w >> 40) & 0xff]++;
+            c[2][(w >> 48) & 0xff]++;
+            c[3][w >> 56]++;
+        }
+
+        for (z &= 7; z; z--)
+            c[0][*ib++]++;
+
+        for (n = 0; n < 256; n++)
+            freqs[n] += (size_t)c[0][n] + c[1][n] + c[2][n] + c[3][n];
+    }
 }
 
 
-int ttcdt_huff_build_tree_from_data(const unsigned char *ib, int uz, struct node *tree)
-/* builds a tree from an input buffer */
+struct sym_freq {
+    size_t f;   /* frequency */
+    int c;      /* char */
+};
+
+
+static int cmp_sym_freq(const void *a, const void *b)
+/* sorts by frequency, then by char */
 {
-    int n, m, r;
-    int freqs[256];
-    int tz = 0;
+    const struct sym_freq *x = a;
+    const struct sym_freq *y = b;
 
-    /* reset */
-    memset(tree, '\0', sizeof(struct node) * NUM_NODES);
-    memset(freqs, '\0', sizeof(freqs));
+    if (x->f != y->f)
+        return x->f < y->f ? -1 : 1;
 
-    /* count frequency of symbols in data */
-    for (n = 0; n < uz; n++)
-        freqs[ib[n]]++;
+    return x->c - y->c;
+}
 
-    /* add all symbols as leaf nodes */
-    m = -1;
-    for (n = 0; n < 256; n++) {
-        if (freqs[n])
-            m = insert_node(m, &tz, freqs[n], -1, -1, n, tree);
+
+int ttcdt_huff_build_lengths(const size_t *freqs, int max_bits,
+                             int *n_bits, unsigned char *syms)
+/* builds the code lengths for the symbols with a non-zero frequency
+   in @freqs, none of them longer than @max_bits, into @n_bits.
+   The used symbols are stored in @syms, in symbol order.
+   Returns the number of used symbols */
+{
+    struct sym_freq sf[256];
+    size_t a[256];
+    int count[MAX_CODE + 1];
+    int n, m, z, root, leaf, next, avbl, used, dpth;
+    uint64_t total;
+
+    memset(n_bits, '\0', sizeof(int) * 256);
+
+    /* collect the used symbols */
+    for (n = z = 0; n < 256; n++) {
+        if (freqs[n]) {
+            sf[z].f = freqs[n];
+            sf[z].c = n;
+            syms[z] = n;
+            z++;
+        }
+    }
+
+    /* a lonely symbol takes no bits */
+    if (z < 2)
+        return z;
+
+    /* all symbols must fit */
+    if (max_bits > MAX_CODE)
+        max_bits = MAX_CODE;
+    while (max_bits < 8 && (1 << max_bits) < z)
+        max_bits++;
+
+    /* sort them once, from least to most frequent */
+    qsort(sf, z, sizeof(sf[0]), cmp_sym_freq);
+
+    for (n = 0; n < z; n++)
+        a[n] = sf[n].f;
+
+    /* build the lengths in place (Moffat & Katajainen): the lowest
+       frequency leaves and internal nodes are taken from two queues,
+       the leaves at the tail of the array and the internal nodes
+       (stored over the already consumed leaves) at its head */
+    a[0] += a[1];
+    root = 0;
+    leaf = 2;
+
+    for (next = 1; next < z - 1; next++) {
+        /* first child */
+        if (leaf >= z || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        }
+        else
+            a[next] = a[leaf++];
+
+        /* second child */
+        if (leaf >= z || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
+        }
+        else
+            a[next] += a[leaf++];
     }
 
-    /* build the internal nodes:
-       they are created by iterating the tree from the lowest
-       frequency nodes. An internal node has two leaf nodes
-       and has a frequency that is the sum of both */
-    for (r = m; tree[r].n != -1; r = tree[n].n) {
-        n = tree[r].n;
-        m = insert_node(m, &tz, tree[r].f + tree[n].f, r, n, '\0', tree);
+    /* convert the parent pointers of the internal nodes to depths */
+    a[z - 2] = 0;
+    for (next = z - 3; next >= 0; next--)
+        a[next] = a[a[next]] + 1;
+
+    /* convert the depths of the internal nodes to depths of leaves */
+    avbl = 1;
+    used = dpth = 0;
+    root = z - 2;
+    next = z - 1;
+
+    while (avbl > 0) {
+        while (root >= 0 && a[root] == dpth) {
+            used++;
+            root--;
+        }
+
+        while (avbl > used) {
+            a[next--] = dpth;
+            avbl--;
+        }
+
+        avbl = 2 * used;
+        dpth++;
+        used = 0;
     }
 
-    return r;
-}
+    /* count the codes of each length, truncating the longest ones */
+    memset(count, '\0', sizeof(count));
 
+    for (n = 0; n < z; n++)
+        count[a[n] > max_bits ? max_bits : a[n]]++;
 
-void ttcdt_huff_build_symbols(const struct node *tree, int r,
-                        int b, int v, int *n_bits, int *values)
-/* builds the bits and values from a tree (recursive) */
-{
-    if (tree[r].b[0] == -1 && tree[r].b[1] == -1) {
-        /* found leaf node */
-        n_bits[tree[r].c] = b;
-        values[tree[r].c] = v;
+    /* the truncation may have overflowed the code space;
+       move codes down the tree until it fits again */
+    for (n = 1, total = 0; n <= max_bits; n++)
+        total += (uint64_t)count[n] << (max_bits - n);
+
+    while (total > (uint64_t)1 << max_bits) {
+        /* take out one of the longest codes... */
+        count[max_bits]--;
+
+        /* ...by turning a shorter one into two longer */
+        for (n = max_bits - 1; n > 0; n--) {
+            if (count[n]) {
+                count[n]--;
+                count[n + 1] += 2;
+                break;
+            }
+        }
+
+        total--;
     }
-    else {
-        ttcdt_huff_build_symbols(tree, tree[r].b[0], b + 1, v,            n_bits, values);
-        ttcdt_huff_build_symbols(tree, tree[r].b[1], b + 1, v | (1 << b), n_bits, values);
+
+    /* the least frequent symbols get the longest codes */
+    for (n = max_bits, m = 0; n > 0; n--) {
+        while (count[n]--)
+            n_bits[sf[m++].c] = n;
     }
+
+    return z;
 }
 
 
-unsigned char *ttcdt_huff_compress_tree(const struct node *tree, unsigned char *ob)
-/* compresses a tree into @ob.
-   Returns a pointer to the next byte in @ob */
+static unsigned char *write_symbols(unsigned char *ob, int *im,
+                                    const unsigned char *syms, int z)
+/* writes the set of @z symbols in @syms (sorted) into @ob */
 {
     int n, c, xc;
-    int im = 0x80;
-    unsigned char *cptr;
-
-    /* save the position where the count of leaf nodes will be stored */
-    cptr = ob;
-    ob++;
 
     n = xc = 0;
-    while (tree[n].b[0] == -1 && tree[n].b[1] == -1) {
+    while (n < z) {
         c = 0;
 
-        /* count how many entries in the tree are consecutive */
-        while (tree[n].b[0] == -1 && tree[n].b[1] == -1 && xc == tree[n].c) {
+        /* count how many symbols are consecutive */
+        while (n < z && xc == syms[n]) {
             c++;
-            xc = tree[n].c + 1;
+            xc = syms[n] + 1;
             n++;
         }
 
         if (c) {
             /* store a run-length count (bit: 0) */
-            ob = write_bits(ob, &im, 1, 0);
-            ob = write_bits(ob, &im, 8, c);
+            ob = write_bits(ob, im, 1, 0);
+            ob = write_bits(ob, im, 8, c);
         }
 
         /* store all unexpected values as verbatim symbols (bit: 1) */
-        while (tree[n].b[0] == -1 && tree[n].b[1] == -1 && xc != tree[n].c) {
-            ob = write_bits(ob, &im, 1, 1);
-            ob = write_bits(ob, &im, 8, tree[n].c);
-            xc = tree[n].c + 1;
+        while (n < z && xc != syms[n]) {
+            ob = write_bits(ob, im, 1, 1);
+            ob = write_bits(ob, im, 8, syms[n]);
+            xc = syms[n] + 1;
 
             n++;
         }
     }
 
-    /* store the count */
-    /* note: 0 means 256 nodes (truncation helps us) */
-    *cptr = n;
+    return ob;
+}
 
-    /* align to byte */
-    if (im != 0x80)
-        ob++;
 
-    /* save the position where count of internal nodes will be stored */
-    cptr = ob;
-    ob++;
+void ttcdt_huff_canonical(const int *n_bits, uint32_t *codes)
+/* assigns the canonical codes for the @n_bits code lengths:
+   codes are consecutive in order of length, then symbol */
+{
+    int count[MAX_CODE + 1];
+    uint32_t next[MAX_CODE + 1];
+    uint32_t c = 0;
+    int n;
+
+    memset(count, '\0', sizeof(count));
 
-    /* store only branches */
-    for (c = 0; tree[n].b[0] || tree[n].b[1]; n++, c++) {
-        ob = write_bits(ob, &im, 9, tree[n].b[0]);
-        ob = write_bits(ob, &im, 9, tree[n].b[1]);
+    for (n = 0; n < 256; n++)
+        count[n_bits[n]]++;
+
+    /* first code of each length */
+    count[0] = 0;
+    for (n = 1; n <= MAX_CODE; n++) {
+        c = (c + count[n - 1]) << 1;
+        next[n] = c;
     }
 
+    for (n = 0; n < 256; n++)
+        codes[n] = n_bits[n] ? next[n_bits[n]]++ : 0;
+}
+
+
+unsigned char *ttcdt_huff_compress_lengths(const unsigned char *syms, int z,
+                                           const int *n_bits, unsigned char *ob)
+/* compresses the code lengths of the @z symbols in @syms into @ob.
+   Returns a pointer to the next byte in @ob */
+{
+    int n, w, m;
+    int im = 0x80;
+
     /* store the count */
-    *cptr = c;
+    /* note: 0 means 256 symbols (truncation helps us) */
+    *ob++ = z;
 
-    if (im != 0x80)
+    /* store the symbols */
+    ob = write_symbols(ob, &im, syms, z);
+
+    /* bits needed to store the lengths */
+    for (n = m = 0; n < z; n++) {
+        if (n_bits[syms[n]] > m)
+            m = n_bits[syms[n]];
+    }
+
+    for (w = 0; m >> w; w++);
+
+    /* store the width and the lengths */
+    ob = write_bits(ob, &im, 3, w);
+
+    for (n = 0; n < z; n++)
+        ob = write_bits(ob, &im, w, n_bits[syms[n]]);
+
+    /* align to byte, padding with zeros */
+    if (im != 0x80) {
+        *ob &= ~((im << 1) - 1);
         ob++;
+    }
 
     return ob;
 }
 
 
-unsigned char *ttcdt_huff_compress_stream(const unsigned char *ib, int uz,
-                                        unsigned char *ob, int *n_bits, int *values)
+unsigned char *ttcdt_huff_compress_stream(const unsigned char *ib, size_t uz,
+                                        unsigned char *ob, const int *n_bits,
+                                        const uint32_t *codes)
 /* compresses a stream of bytes in @ib to Huffman symbols written onto @ob.
    Returns the pointer to the next byte of @ob */
 {
-    int n;
-    int im = 0x80;
+    uint64_t bb = 0;    /* bit accumulator (first bit in the MSB) */
+    int bc = 0;         /* number of bits in bb */
+    size_t n;
 
-    for (n = 0; n < uz; n++)
-        ob = write_bits(ob, &im, n_bits[ib[n]], values[ib[n]]);
+    /* a 0-bit code means it's the only symbol: nothing to write */
+    if (uz == 0 || n_bits[ib[0]] == 0)
+        return ob;
 
-    if (im != 0x80)
-        ob++;
+    for (n = 0; n < uz; n++) {
+        uint64_t c = codes[ib[n]];
+        int b = n_bits[ib[n]];
+
+        if (bc + b > 64) {
+            /* fill the accumulator and flush its 8 bytes */
+            int r = bc + b - 64;
+            int m;
+
+            bb |= c >> r;
+
+            for (m = 56; m >= 0; m -= 8)
+                *ob++ = bb >> m;
+
+            /* keep the bits that didn't fit */
+            bb = r ? c << (64 - r) : 0;
+            bc = r;
+        }
+        else {
+            bb |= c << (64 - bc - b);
+            bc += b;
+        }
+    }
+
+    /* flush the remaining bytes, the last one padded with zeros */
+    while (bc > 0) {
+        *ob++ = bb >> 56;
+        bb <<= 8;
+        bc -= 8;
+    }
 
     return ob;
 }
@@ -243,44 +577,60 @@ unsigned char *ttcdt_huff_compress_stream(const unsigned char *ib, int uz,
 
 /** decompression **/
 
-const unsigned char *ttcdt_huff_decompress_tree(const unsigned char *ib, int *r,
-                                              struct node *tree)
-/* decompresses a compressed tree from inside @ib into a usable tree.
-   The root node will be stored into @r.
-   The tree will not have frequency information,
-   but that is not necessary for decompression */
+int ttcdt_huff_build_symbols(const struct node *tree, int r,
+                        int b, int v, int *n_bits, int *values, int *z)
+/* builds the bits and values from a tree (recursive).
+   @z counts the leaves found, to stop on malformed trees.
+   Returns -1 if the tree is not usable */
 {
-    int n, c, xc;
-    int im = 0x80;
+    if (r < 0 || r >= NUM_NODES || *z >= 256)
+        return -1;
 
-    /* reset the tree */
-    memset(tree, '\0', sizeof(struct node) * NUM_NODES);
+    if (tree[r].b[0] == -1 && tree[r].b[1] == -1) {
+        /* found leaf node */
+        n_bits[tree[r].c & 0xff] = b;
+        values[tree[r].c & 0xff] = v;
+        (*z)++;
+    }
+    else {
+        /* branches always point to previously created nodes */
+        if (tree[r].b[0] >= r || tree[r].b[1] >= r || b >= MAX_CODE)
+            return -1;
+
+        if (ttcdt_huff_build_symbols(tree, tree[r].b[0], b + 1, v,
+                                     n_bits, values, z) == -1 ||
+            ttcdt_huff_build_symbols(tree, tree[r].b[1], b + 1, v | (1 << b),
+                                     n_bits, values, z) == -1)
+            return -1;
+    }
+
+    return 0;
+}
 
-    /* get the count of leaf nodes */
-    c = *ib;
-    ib++;
 
-    /* '0' elements means there is an entry for every char */
-    if (c == 0)
-        c = 256;
+
+static const unsigned char *read_symbols(const unsigned char *ib, int *im,
+                                         unsigned char *syms, int z)
+/* reads a set of @z symbols from @ib into @syms */
+{
+    int n, xc;
 
     n = xc = 0;
-    while (n < c) {
+    while (n < z) {
         int p, v;
 
         /* read prefix and value */
         p = v = 0;
-        ib = read_bits(ib, &im, 1, &p);
-        ib = read_bits(ib, &im, 8, &v);
+        ib = read_bits(ib, im, 1, &p);
+        ib = read_bits(ib, im, 8, &v);
 
         if (p == 0) {
             /* prefix is 0: run-length sequence of consecutive values */
             if (v == 0)
                 v = 256;
 
-            while (v) {
-                tree[n].b[0] = tree[n].b[1] = -1;
-                tree[n].c = xc;
+            while (v && n < z) {
+                syms[n] = xc;
                 xc++;
                 n++;
                 v--;
@@ -288,13 +638,46 @@ const unsigned char *ttcdt_huff_decompress_tree(const unsigned char *ib, int *r,
         }
         else {
             /* prefix is 1: as-is char */
-            tree[n].b[0] = tree[n].b[1] = -1;
-            tree[n].c = v;
+            syms[n] = v;
             xc = v + 1;
             n++;
         }
     }
 
+    return ib;
+}
+
+
+const unsigned char *ttcdt_huff_decompress_tree(const unsigned char *ib, int *r,
+                                              struct node *tree)
+/* decompresses a compressed tree from inside @ib into a usable tree.
+   The root node will be stored into @r.
+   The tree will not have frequency information,
+   but that is not necessary for decompression */
+{
+    unsigned char syms[256];
+    int n, c;
+    int im = 0x80;
+
+    /* reset the tree */
+    memset(tree, '\0', sizeof(struct node) * NUM_NODES);
+
+    /* get the count of leaf nodes */
+    c = *ib;
+    ib++;
+
+    /* '0' elements means there is an entry for every char */
+    if (c == 0)
+        c = 256;
+
+    /* the leaf nodes */
+    ib = read_symbols(ib, &im, syms, c);
+
+    for (n = 0; n < c; n++) {
+        tree[n].b[0] = tree[n].b[1] = -1;
+        tree[n].c = syms[n];
+    }
+
     if (im != 0x80)
         ib++;
 
@@ -317,117 +700,2023 @@ const unsigned char *ttcdt_huff_decompress_tree(const unsigned char *ib, int *r,
 }
 
 
-const unsigned char *ttcdt_huff_decompress_stream(const struct node *tree, int r,
-                                                const unsigned char *ib, int uz,
-                                                unsigned char *ob)
-/* decompresses a compressed stream of @uz Huffman symbols.
-   Returns the pointer to the next byte of @ib */
+const unsigned char *ttcdt_huff_decompress_lengths(const unsigned char *ib,
+                                                   int *n_bits, uint32_t *codes,
+                                                   int *single)
+/* decompresses the code lengths from inside @ib and assigns
+   their canonical codes. If there is only one symbol with
+   a 0-bit code, it's stored in @single (-1 otherwise).
+   Returns NULL if the lengths are out of range */
 {
-    int n = 0;
+    unsigned char syms[256];
+    int n, c, w = 0;
     int im = 0x80;
 
-    for (n = 0; n < uz; n++) {
-        int c = -1;
-        int nr = r;
+    memset(n_bits, '\0', sizeof(int) * 256);
 
-        do {
-            if (nr < 0 || nr >= NUM_NODES)
-                goto end;           /* corrupted stream */
-            else
-            if (tree[nr].b[0] == -1 && tree[nr].b[1] == -1)
-                c = tree[nr].c;     /* symbol found */
-            else {
-                int b;
+    /* get the count of symbols */
+    c = *ib;
+    ib++;
 
-                /* pick the branch */
-                ib = read_bits(ib, &im, 1, &b);
-                nr = tree[nr].b[b & 0x01];
-            }
-        } while (c == -1);
+    if (c == 0)
+        c = 256;
+
+    ib = read_symbols(ib, &im, syms, c);
+
+    /* get the width and the lengths */
+    ib = read_bits(ib, &im, 3, &w);
+
+    for (n = 0; n < c; n++) {
+        int b = 0;
 
-        ob[n] = c;
+        ib = read_bits(ib, &im, w, &b);
+
+        if (b > MAX_CODE)
+            return NULL;
+
+        n_bits[syms[n]] = b;
     }
 
     if (im != 0x80)
         ib++;
 
-end:
+    ttcdt_huff_canonical(n_bits, codes);
+
+    *single = c == 1 && n_bits[syms[0]] == 0 ? syms[0] : -1;
+
     return ib;
 }
 
 
-#ifdef TTCDT_HUFF_DEBUG
-
-void print_tree(struct node *tree, int i)
+static void build_multi(struct table *t)
+/* builds the multi-symbol table from the first-level one: each
+   entry holds the codes that fit whole in the bits of its index */
 {
-    printf("\n");
-    while (i != -1) {
-        printf("i: %3d n: %3d f: %3d l: %3d r: %3d c: '%c' (%02x)\n",
-            i, tree[i].n, tree[i].f, tree[i].b[0], tree[i].b[1],
-            tree[i].c, tree[i].c);
+    int i;
+
+    for (i = 0; i < 1 << TABLE_BITS; i++) {
+        struct multi *m = &t->m[i];
+        int b = 0;
+
+        m->k = 0;
 
-        i = tree[i].n;
+        while (m->k < MULTI_MAX) {
+            /* the code starting after the b bits already used */
+            struct entry e = t->e[(i << b) & ((1 << TABLE_BITS) - 1)];
+
+            if (e.s || e.n == 0 || b + e.n > TABLE_BITS)
+                break;
+
+            m->v[m->k++] = e.v;
+            b += e.n;
+        }
+
+        m->n = b;
     }
 }
 
 
-void print_tree_raw(struct node *tree)
+int ttcdt_huff_build_table(const int *n_bits, const uint32_t *codes,
+                           int single, struct table *t)
+/* builds the decoding tables from the code lengths and codes.
+   Codes up to TABLE_BITS long are resolved by the first-level table;
+   longer ones by second-level tables hanging from it and, if they
+   don't fit there, by a scan of the longs list. @single is the
+   only symbol, if it has a 0-bit code, or -1.
+   Returns -1 if the codes are not usable */
 {
-    int i = 0;
+    unsigned char max_sub[1 << TABLE_BITS];
+    uint64_t kraft = 0, avg = 0;
+    int n, m, z;
 
-    printf("\n");
-    while (tree[i].b[0] || tree[i].b[1]) {
-        printf("i: %3d n: %3d f: %3d l: %3d r: %3d c: '%c' (%02x)\n",
-            i, tree[i].n, tree[i].f, tree[i].b[0], tree[i].b[1],
-            tree[i].c, tree[i].c);
+    /* only the first level; subtables are cleared when assigned */
+    memset(t->e, '\0', sizeof(struct entry) << TABLE_BITS);
+    memset(max_sub, '\0', sizeof(max_sub));
+    t->single   = single;
+    t->max_bits = 1;
+    t->n_long   = 0;
 
-        i++;
+    for (n = 0; n < 256; n++) {
+        int b = n_bits[n];
+
+        if (b < 0 || b > MAX_CODE || (b && codes[n] >> b))
+            return -1;
+
+        t->n_bits[n] = b;
+        t->codes[n]  = codes[n];
+
+        if (b) {
+            kraft += (uint64_t)1 << (MAX_CODE - b);
+
+            /* a code of b bits takes 1/2^b of the symbols */
+            avg += (uint64_t)b << (MAX_CODE - b);
+        }
+
+        if (b > t->max_bits)
+            t->max_bits = b;
+
+        /* track the longest code below each first-level prefix */
+        if (b > TABLE_BITS) {
+            int p = t->codes[n] >> (b - TABLE_BITS);
+
+            if (b - TABLE_BITS > max_sub[p])
+                max_sub[p] = b - TABLE_BITS;
+        }
     }
-}
 
-#endif /* TTCDT_HUFF_DEBUG */
+    /* more codes than fit in the code space, or
+       a 0-bit code with others */
+    if (kraft > (uint64_t)1 << MAX_CODE || (single != -1 && kraft))
+        return -1;
+
+    /* assign room for the subtables */
+    for (n = 0, z = 1 << TABLE_BITS; n < (1 << TABLE_BITS); n++) {
+        if (max_sub[n]) {
+            int sb = max_sub[n] > TABLE_BITS ? TABLE_BITS : max_sub[n];
+
+            if (z + (1 << sb) <= (1 << TABLE_BITS) + SUB_SIZE) {
+                memset(&t->e[z], '\0', sizeof(struct entry) << sb);
+                t->e[n].v = z;
+                t->e[n].n = TABLE_BITS;
+                t->e[n].s = sb;
+                z += 1 << sb;
+            }
+        }
+    }
 
+    /* fill the entries */
+    for (n = 0; n < 256; n++) {
+        int b = t->n_bits[n];
+        struct entry e;
 
-/** interface **/
+        if (b == 0)
+            continue;
 
-unsigned char *ttcdt_huff_compress(const unsigned char *ib, int uz, unsigned char *ob)
-/* compresses @uz bytes from @ib into @ob.
-   Returns the pointer to the next byte of @ob */
-{
-    struct node tree[NUM_NODES];
-    int r;
-    int n_bits[256];
-    int values[256];
-    int im = 0x80;
+        e.v = n;
+        e.n = b;
+        e.s = 0;
 
-    /* build a tree using this data buffer */
-    r = ttcdt_huff_build_tree_from_data(ib, uz, tree);
+        if (b <= TABLE_BITS) {
+            /* all indexes starting with this code */
+            int i = t->codes[n] << (TABLE_BITS - b);
 
-#ifdef TTCDT_HUFF_DEBUG
-    print_tree_raw(tree);
-#endif
+            for (m = 0; m < (1 << (TABLE_BITS - b)); m++)
+                t->e[i + m] = e;
+        }
+        else {
+            struct entry *p = &t->e[t->codes[n] >> (b - TABLE_BITS)];
+            int r = b - TABLE_BITS;
+
+            if (p->s && r <= p->s) {
+                /* all indexes of the subtable starting with the rest of the code */
+                int i = p->v + ((t->codes[n] & ((1 << r) - 1)) << (p->s - r));
 
-    /* build bits and values */
-    ttcdt_huff_build_symbols(tree, r, 0, 0, n_bits, values);
+                for (m = 0; m < (1 << (p->s - r)); m++)
+                    t->e[i + m] = e;
+            }
+            else
+                t->longs[t->n_long++] = n;
+        }
+    }
 
-    /* store the number of bytes the decompressed data contains */
-    ob = write_bits(ob, &im, 24, uz);
+    /* with short codes, most lookups can decode several symbols */
+    t->multi = t->m != NULL && avg <= (uint64_t)MULTI_BITS << MAX_CODE;
 
-    /* store the tree in compressed form */
-    ob = ttcdt_huff_compress_tree(tree, ob);
+    if (t->multi)
+        build_multi(t);
 
-    /* compress the data stream */
-    return ttcdt_huff_compress_stream(ib, uz, ob, n_bits, values);
+    return 0;
 }
 
 
-const unsigned char *ttcdt_huff_size(const unsigned char *ib, int *uz)
-/* returns the number of bytes @ib will expand to */
+static struct entry lookup(const struct table *t, uint64_t bb)
+/* finds the entry for the code in the top bits of @bb.
+   The entry has n == 0 if the code is not a valid one */
 {
-    int im = 0x80;
+    struct entry e = t->e[bb >> (64 - TABLE_BITS)];
 
-    return read_bits(ib, &im, 24, uz);
-}
+    if (e.s)
+        e = t->e[e.v + ((bb << TABLE_BITS) >> (64 - e.s))];
+
+    if (e.n == 0) {
+        int n;
+
+        /* not in the tables: it must be one of the long codes */
+        for (n = 0; n < t->n_long; n++) {
+            int c = t->longs[n];
+
+            if ((bb >> (64 - t->n_bits[c])) == t->codes[c]) {
+                e.v = c;
+                e.n = t->n_bits[c];
+                break;
+            }
+        }
+    }
+
+    return e;
+}
+
+
+struct reader {
+    const unsigned char *ib;    /* next byte to load */
+    uint64_t bb;                /* bit buffer (next bit in the MSB) */
+    int bc;                     /* number of bits in bb */
+};
+
+
+static void refill(struct reader *r)
+/* fills the bit buffer up to at least 57 bits */
+{
+    while (r->bc <= 56) {
+        r->bb |= (uint64_t)*r->ib++ << (56 - r->bc);
+        r->bc += 8;
+    }
+}
+
+
+static int decode_one(const struct table *t, struct reader *r, unsigned char *ob)
+/* decodes the symbols of a table lookup from the bit buffer of @r
+   into @ob, that must have room for MULTI_MAX. Returns how many
+   were decoded, or 0 if the code is not a valid one */
+{
+    struct entry e;
+
+    if (t->multi) {
+        const struct multi *m = &t->m[r->bb >> (64 - TABLE_BITS)];
+
+        if (m->k) {
+            memcpy(ob, m->v, MULTI_MAX);
+            r->bb <<= m->n;
+            r->bc -= m->n;
+
+            return m->k;
+        }
+    }
+
+    e = lookup(t, r->bb);
+
+    if (e.n == 0)
+        return 0;
+
+    *ob = e.v;
+    r->bb <<= e.n;
+    r->bc -= e.n;
+
+    return 1;
+}
+
+
+static size_t safe_symbols(const struct table *t, const struct reader *r,
+                           const unsigned char *end)
+/* returns how many symbols can be decoded from @r without
+   checking if a byte at @end or past it is read */
+{
+    size_t a = end - r->ib;
+
+    /* each one takes no more than max_bits, and
+       refill() reads up to 8 bytes ahead of them */
+    return a > 8 ? (a - 8) * 8 / t->max_bits : 0;
+}
+
+
+static int decode_rest(const struct table *t, struct reader *r,
+                       unsigned char *ob, size_t uz, const unsigned char *end)
+/* decodes @uz symbols from @r into @ob. If @end is not NULL,
+   no byte from there on is read. Returns -1 if the stream
+   is corrupted, or -2 if it's cut by @end */
+{
+    size_t n = 0;
+
+    /* every code takes at least one bit, so while more than
+       64 symbols remain the stream is known to have another
+       8 bytes: refill the bit buffer freely */
+    while (n + 64 < uz) {
+        size_t k = uz - 64;
+
+        /* unless the input is cut: decode in runs
+           that are known not to get to its end */
+        if (end != NULL) {
+            size_t m = safe_symbols(t, r, end);
+
+            if (m < 16)
+                break;
+
+            if (k - n > m)
+                k = n + m;
+        }
+
+        /* a lookup may go up to MULTI_MAX - 1 symbols past k,
+           still far from the end */
+        while (n < k) {
+            int d;
+
+            refill(r);
+
+            if ((d = decode_one(t, r, ob + n)) == 0)
+                return -1;
+
+            n += d;
+        }
+    }
+
+    /* near the end, only load bytes when a code needs them */
+    while (n < uz) {
+        struct entry e = lookup(t, r->bb);
+
+        if (e.n == 0 || e.n > r->bc) {
+            if (r->bc > 56)
+                return -1;
+
+            if (end != NULL && r->ib >= end)
+                return -2;
+
+            r->bb |= (uint64_t)*r->ib++ << (56 - r->bc);
+            r->bc += 8;
+        }
+        else {
+            ob[n++] = e.v;
+            r->bb <<= e.n;
+            r->bc -= e.n;
+        }
+    }
+
+    return 0;
+}
+
+
+static int decode_stream(const struct table *t, const unsigned char **ib,
+                         const unsigned char *end, size_t uz, unsigned char *ob)
+/* decompresses a compressed stream of @uz Huffman symbols from @ib,
+   leaving it pointing to the next byte. Returns as decode_rest() */
+{
+    struct reader r;
+    int ret;
+
+    if (t->single != -1) {
+        /* all symbols are the same and take no bits */
+        memset(ob, t->single, uz);
+        return 0;
+    }
+
+    r.ib = *ib;
+    r.bb = 0;
+    r.bc = 0;
+
+    if ((ret = decode_rest(t, &r, ob, uz, end)) == 0) {
+        /* unused whole bytes in the bit buffer belong to the next block */
+        *ib = r.ib - (r.bc >> 3);
+    }
+
+    return ret;
+}
+
+
+const unsigned char *ttcdt_huff_decompress_stream(const struct table *t,
+                                                const unsigned char *ib, size_t uz,
+                                                unsigned char *ob)
+/* decompresses a compressed stream of @uz Huffman symbols.
+   Returns the pointer to the next byte of @ib, or NULL
+   if the stream is corrupted */
+{
+    return decode_stream(t, &ib, NULL, uz, ob) == 0 ? ib : NULL;
+}
+
+
+static int decode_streams(const struct table *t, const unsigned char **ib,
+                          const unsigned char *end, size_t uz, unsigned char *ob)
+/* decompresses @uz Huffman symbols split in interleaved streams
+   from @ib, leaving it pointing to the next byte. Returns as
+   decode_rest() */
+{
+    struct reader r[MAX_STREAMS];
+    size_t at[MAX_STREAMS];
+    int k, w, i, ret, step;
+    size_t q, n;
+    const unsigned char *p = *ib;
+
+    if (end != NULL && p >= end)
+        return -2;
+
+    /* count of streams and width of the sizes */
+    k = *p & 0x0f;
+    w = *p >> 4;
+    p++;
+
+    if (k < 1 || w < 1 || w > 8)
+        return -1;
+
+    if (end != NULL && (size_t)(end - p) < (size_t)(k - 1) * w)
+        return -2;
+
+    /* the streams start after the sizes of all but the last one */
+    *ib = p + (k - 1) * w;
+
+    for (i = 0; i < k; i++) {
+        uint64_t z = 0;
+
+        if (i < k - 1) {
+            for (n = 0; n < w; n++)
+                z |= (uint64_t)*p++ << (n * 8);
+        }
+
+        if (z > SIZE_MAX / 2)
+            return -1;
+
+        if (end != NULL && z > (uint64_t)(end - *ib))
+            return -2;
+
+        r[i].ib = *ib;
+        r[i].bb = 0;
+        r[i].bc = 0;
+
+        *ib += z;
+    }
+
+    /* all streams have the same number of symbols
+       but the last one, that also takes the remainder */
+    q = uz / k;
+
+    if (t->single != -1) {
+        memset(ob, t->single, uz);
+        return 0;
+    }
+
+    /* decode a lookup of each stream in turn, so their dependency
+       chains run in parallel; with multi-symbol tables, they
+       don't all advance at the same pace */
+    step = t->multi ? MULTI_MAX : 1;
+
+    for (i = 0; i < k; i++)
+        at[i] = 0;
+
+    for (;;) {
+        size_t rounds = SIZE_MAX;
+
+        /* as many rounds as the stream nearest to
+           its end (or that of a cut input) allows */
+        for (i = 0; i < k; i++) {
+            size_t b = at[i] + 64 < q ? q - 64 - at[i] : 0;
+
+            if (end != NULL) {
+                size_t s = safe_symbols(t, &r[i], end);
+
+                if (b > s)
+                    b = s;
+            }
+
+            if (rounds > b / step)
+                rounds = b / step;
+        }
+
+        if (rounds < 16)
+            break;
+
+        while (rounds--) {
+            for (i = 0; i < k; i++) {
+                int d;
+
+                refill(&r[i]);
+
+                if ((d = decode_one(t, &r[i], ob + i * q + at[i])) == 0)
+                    return -1;
+
+                at[i] += d;
+            }
+        }
+    }
+
+    /* finish them one by one */
+    for (i = 0; i < k; i++) {
+        size_t z = (i == k - 1 ? uz - (k - 1) * q : q) - at[i];
+
+        if ((ret = decode_rest(t, &r[i], ob + i * q + at[i], z, end)) != 0)
+            return ret;
+    }
+
+    i = k - 1;
+    *ib = r[i].ib - (r[i].bc >> 3);
+
+    return 0;
+}
+
+
+const unsigned char *ttcdt_huff_decompress_streams(const struct table *t,
+                                                 const unsigned char *ib, size_t uz,
+                                                 unsigned char *ob)
+/* decompresses @uz Huffman symbols split in interleaved streams.
+   Returns the pointer to the next byte of @ib, or NULL
+   if the streams are corrupted */
+{
+    return decode_streams(t, &ib, NULL, uz, ob) == 0 ? ib : NULL;
+}
+
+
+#ifdef TTCDT_HUFF_DEBUG
+
+void print_tree_raw(struct node *tree)
+{
+    int i = 0;
+
+    printf("\n");
+    while (tree[i].b[0] || tree[i].b[1]) {
+        printf("i: %3d n: %3d f: %3d l: %3d r: %3d c: '%c' (%02x)\n",
+            i, tree[i].n, tree[i].f, tree[i].b[0], tree[i].b[1],
+            tree[i].c, tree[i].c);
+
+        i++;
+    }
+}
+
+#endif /* TTCDT_HUFF_DEBUG */
+
+
+/** tANS **/
+
+/* Table-based asymmetric numeral systems: the frequencies of the
+   symbols are scaled to add up to a power of two, and each symbol
+   owns that many states of a finite state machine, spread over
+   its table. A symbol costs the fractional number of bits its
+   share of states says, so very skewed data codes in much less
+   than with the whole-bit Huffman codes.
+
+   The encoder walks the data backwards from the first state; the
+   stream starts with its last state, so the decoder walks it
+   forwards and must end at the first state. Even and odd symbols
+   go through two separate states, so each step doesn't have to
+   wait for the previous one */
+
+static int high_bit(uint32_t v)
+/* returns the position of the highest bit set in @v (0 for 0) */
+{
+    int n;
+
+    for (n = 0; v >> (n + 1); n++);
+
+    return n;
+}
+
+
+static int ans_log(size_t uz, int z)
+/* returns the log2 of the number of states
+   for @uz bytes of data with @z symbols */
+{
+    int tl = ANS_LOG;
+
+    /* small blocks don't need that much precision */
+    while (tl > ANS_MIN_LOG && ((size_t)1 << (tl - 1)) >= uz)
+        tl--;
+
+    /* every symbol needs a state */
+    while ((1 << tl) < z)
+        tl++;
+
+    return tl;
+}
+
+
+static void ans_normalize(const size_t *freqs, size_t uz, int tl, int *norm)
+/* scales the @freqs of @uz bytes into @norm, adding up to
+   1 << @tl, keeping at least one state for every symbol */
+{
+    int n, m = 0, d = 1 << tl;
+
+    for (n = 0; n < 256; n++) {
+        norm[n] = 0;
+
+        if (freqs[n]) {
+            norm[n] = (int)((double)freqs[n] * (1 << tl) / uz + 0.5);
+
+            if (norm[n] == 0)
+                norm[n] = 1;
+
+            if (norm[n] > norm[m])
+                m = n;
+
+            d -= norm[n];
+        }
+    }
+
+    /* the rounding error goes to the most frequent
+       symbol, unless it's too much for it */
+    if (norm[m] + d > norm[m] / 2) {
+        norm[m] += d;
+        return;
+    }
+
+    /* otherwise, states are taken one by one from the biggest */
+    while (d < 0) {
+        for (n = 0; n < 256; n++) {
+            if (norm[n] > norm[m])
+                m = n;
+        }
+
+        norm[m]--;
+        d++;
+    }
+}
+
+
+static void ans_spread(const int *norm, int tl, unsigned char *ts)
+/* spreads the states of each symbol over the table @ts */
+{
+    int n, m, i = 0;
+    int step = (1 << (tl - 1)) + (1 << (tl - 3)) + 3;
+    int mask = (1 << tl) - 1;
+
+    /* an odd step visits every state once */
+    for (n = 0; n < 256; n++) {
+        for (m = 0; m < norm[n]; m++) {
+            ts[i] = n;
+            i = (i + step) & mask;
+        }
+    }
+}
+
+
+static void ans_build_enc(struct ans_enc *a, const int *norm, int tl)
+/* builds the coding tables of @a from the @norm frequencies */
+{
+    unsigned char ts[1 << ANS_LOG];
+    int next[256];
+    int n, c, b, l = 1 << tl;
+
+    ans_spread(norm, tl, ts);
+
+    a->log = tl;
+
+    /* the states of each symbol, in order, from its first index */
+    for (n = c = 0; n < 256; n++) {
+        next[n] = c;
+        a->s[n].ds = c - norm[n];
+        c += norm[n];
+    }
+
+    for (n = 0; n < l; n++)
+        a->st[next[ts[n]]++] = l + n;
+
+    /* a state x takes b or b - 1 bits to get back
+       into [norm, norm * 2): b if x >= norm << b */
+    for (n = 0; n < 256; n++) {
+        if (norm[n]) {
+            b = tl - high_bit(norm[n] - 1);
+            a->s[n].dn = ((uint32_t)b << 16) - ((uint32_t)norm[n] << b);
+        }
+    }
+}
+
+
+static void ans_build_dec(struct ans_dec *a, const int *norm, int tl)
+/* builds the decoding table of @a from the @norm frequencies */
+{
+    unsigned char ts[1 << ANS_LOG];
+    int next[256];
+    int n, x, b, l = 1 << tl;
+
+    ans_spread(norm, tl, ts);
+
+    memcpy(next, norm, sizeof(next));
+
+    a->log = tl;
+
+    for (n = 0; n < l; n++) {
+        x = next[ts[n]]++;
+        b = tl - high_bit(x);
+
+        a->d[n].s = ts[n];
+        a->d[n].n = b;
+        a->d[n].x = (x << b) - l;
+    }
+}
+
+
+static unsigned char *ans_write_norm(const int *norm, int tl,
+                                     const unsigned char *syms, int z,
+                                     unsigned char *ob)
+/* writes the table size @tl and the @norm frequencies of
+   the @z symbols in @syms into @ob, as compress_lengths() */
+{
+    int n, w, m;
+    int im = 0x80;
+
+    *ob++ = tl;
+    *ob++ = z;
+
+    ob = write_symbols(ob, &im, syms, z);
+
+    /* no symbol has less than one state, so store one less */
+    for (n = m = 0; n < z; n++) {
+        if (norm[syms[n]] - 1 > m)
+            m = norm[syms[n]] - 1;
+    }
+
+    for (w = 0; m >> w; w++);
+
+    ob = write_bits(ob, &im, 4, w);
+
+    for (n = 0; n < z; n++)
+        ob = write_bits(ob, &im, w, norm[syms[n]] - 1);
+
+    if (im != 0x80) {
+        *ob &= ~((im << 1) - 1);
+        ob++;
+    }
+
+    return ob;
+}
+
+
+static const unsigned char *ans_read_norm(const unsigned char *ib,
+                                          int *norm, int *tl)
+/* reads what ans_write_norm() writes. Returns NULL
+   if the frequencies don't fill the table */
+{
+    unsigned char syms[256];
+    int n, c, t = 0, w = 0;
+    int im = 0x80;
+
+    memset(norm, '\0', sizeof(int) * 256);
+
+    *tl = *ib++;
+
+    if (*tl < ANS_MIN_LOG || *tl > ANS_LOG)
+        return NULL;
+
+    c = *ib++;
+
+    if (c == 0)
+        c = 256;
+
+    ib = read_symbols(ib, &im, syms, c);
+    ib = read_bits(ib, &im, 4, &w);
+
+    for (n = 0; n < c; n++) {
+        int v = 0;
+
+        ib = read_bits(ib, &im, w, &v);
+
+        norm[syms[n]] += v + 1;
+        t += v + 1;
+    }
+
+    if (im != 0x80)
+        ib++;
+
+    return t == 1 << *tl ? ib : NULL;
+}
+
+
+static uint32_t ans_count(const struct ans_enc *a, uint32_t x, int c, uint64_t *b)
+/* codes @c from state @x, adding the bits it takes to @b.
+   Returns the new state */
+{
+    const struct ans_sym *s = &a->s[c];
+    int n = (x + s->dn) >> 16;
+
+    *b += n;
+
+    return a->st[(x >> n) + s->ds];
+}
+
+
+static uint32_t ans_put(const struct ans_enc *a, uint32_t x, int c,
+                        uint64_t *bb, int *bc)
+/* codes @c from state @x, adding its bits over the @bc
+   ones in @bb. Returns the new state */
+{
+    const struct ans_sym *s = &a->s[c];
+    int n = (x + s->dn) >> 16;
+
+    *bb |= (uint64_t)(x & ((1 << n) - 1)) << *bc;
+    *bc += n;
+
+    return a->st[(x >> n) + s->ds];
+}
+
+
+static uint64_t ans_bits(const struct ans_enc *a, const unsigned char *ib, size_t uz)
+/* returns the size in bits of the tANS stream of @uz bytes from @ib */
+{
+    uint64_t b = a->log * 2;
+    uint32_t x0 = 1 << a->log;
+    uint32_t x1 = x0;
+    size_t i = uz;
+
+    if (i & 1)
+        x0 = ans_count(a, x0, ib[--i], &b);
+
+    while (i) {
+        x1 = ans_count(a, x1, ib[--i], &b);
+        x0 = ans_count(a, x0, ib[--i], &b);
+    }
+
+    return b;
+}
+
+
+static unsigned char *ans_encode(const struct ans_enc *a, const unsigned char *ib,
+                                 size_t uz, unsigned char *ob, uint64_t bits)
+/* writes the tANS stream of @uz bytes from @ib, of @bits bits
+   as ans_bits() tells, into @ob. Returns the pointer to the next byte */
+{
+    size_t z = (bits + 7) / 8;
+    unsigned char *p = ob + z;
+    uint32_t l = 1 << a->log;
+    uint32_t x0 = l;
+    uint32_t x1 = l;
+    uint64_t bb = 0;
+    int bc = (int)(z * 8 - bits);
+    size_t i = uz;
+
+    /* the bits of each step go before those of the previous one:
+       fill the stream from its end, padding included */
+    if (i & 1)
+        x0 = ans_put(a, x0, ib[--i], &bb, &bc);
+
+    while (i) {
+        x1 = ans_put(a, x1, ib[--i], &bb, &bc);
+        x0 = ans_put(a, x0, ib[--i], &bb, &bc);
+
+        /* two steps add no more than 2 * ANS_LOG bits */
+        if (bc >= 32) {
+            p -= 4;
+            p[0] = (unsigned char)(bb >> 24);
+            p[1] = (unsigned char)(bb >> 16);
+            p[2] = (unsigned char)(bb >> 8);
+            p[3] = (unsigned char)bb;
+
+            bb >>= 32;
+            bc -= 32;
+        }
+    }
+
+    /* the last states, for the decoder to start from */
+    bb |= (uint64_t)(x1 - l) << bc;
+    bc += a->log;
+    bb |= (uint64_t)(x0 - l) << bc;
+    bc += a->log;
+
+    while (bc > 0) {
+        *--p = (unsigned char)bb;
+        bb >>= 8;
+        bc -= 8;
+    }
+
+    return ob + z;
+}
+
+
+static int fill(struct reader *r, int n, const unsigned char *end)
+/* loads bytes into the bit buffer of @r until it has @n bits,
+   not reading from @end on. Returns 0 if there are not enough */
+{
+    while (r->bc < n) {
+        if (r->ib >= end)
+            return 0;
+
+        r->bb |= (uint64_t)*r->ib++ << (56 - r->bc);
+        r->bc += 8;
+    }
+
+    return 1;
+}
+
+
+static unsigned take(struct reader *r, int n)
+/* takes @n bits (up to 63, maybe 0) from the bit buffer of @r */
+{
+    unsigned v = (unsigned)((r->bb >> 1) >> (63 - n));
+
+    r->bb <<= n;
+    r->bc -= n;
+
+    return v;
+}
+
+
+static unsigned ans_get(const struct ans_entry *d, unsigned x,
+                        struct reader *r, unsigned char *ob)
+/* decodes the symbol of state @x into @ob, taking
+   the bits of the next state from @r. Returns it */
+{
+    const struct ans_entry *e = &d[x];
+
+    *ob = e->s;
+
+    return e->x + take(r, e->n);
+}
+
+
+static int decode_ans(const struct ans_dec *a, const unsigned char **ib,
+                      const unsigned char *end, size_t uz, unsigned char *ob)
+/* decompresses a tANS stream of @uz symbols from @ib, leaving it
+   pointing to the next byte. Returns as decode_rest() */
+{
+    const struct ans_entry *d = a->d;
+    const unsigned char *p = *ib;
+    struct reader r;
+    uint64_t z = 0;
+    size_t n = 0;
+    unsigned x0, x1;
+    int s = 0;
+
+    /* the size of the stream, as symbols may take no bits
+       and don't tell where it ends */
+    do {
+        if (end != NULL && p >= end)
+            return -2;
+
+        if (s > 63)
+            return -1;
+
+        z |= (uint64_t)(*p & 0x7f) << s;
+        s += 7;
+    } while (*p++ & 0x80);
+
+    if (end != NULL && z > (uint64_t)(end - p))
+        return -2;
+
+    end = p + z;
+
+    r.ib = p;
+    r.bb = 0;
+    r.bc = 0;
+
+    if (!fill(&r, a->log * 2, end))
+        return -1;
+
+    x0 = take(&r, a->log);
+    x1 = take(&r, a->log);
+
+    for (;;) {
+        size_t m = end - r.ib > 8 ? (end - r.ib - 8) * 8 / a->log : 0;
+
+        /* decode in runs known not to refill past the end */
+        if (m > uz - n)
+            m = uz - n;
+
+        if (m < 4)
+            break;
+
+        m = n + (m & ~(size_t)3);
+
+        /* four steps take no more bits than a refill leaves,
+           and the two states don't wait for each other */
+        while (n < m) {
+            refill(&r);
+
+            x0 = ans_get(d, x0, &r, ob + n);
+            x1 = ans_get(d, x1, &r, ob + n + 1);
+            x0 = ans_get(d, x0, &r, ob + n + 2);
+            x1 = ans_get(d, x1, &r, ob + n + 3);
+
+            n += 4;
+        }
+    }
+
+    /* near the end, only load bytes when a state needs them */
+    for (; n < uz; n++) {
+        if (!fill(&r, d[n & 1 ? x1 : x0].n, end))
+            return -1;
+
+        if (n & 1)
+            x1 = ans_get(d, x1, &r, ob + n);
+        else
+            x0 = ans_get(d, x0, &r, ob + n);
+    }
+
+    /* the encoder started from the first state, and used the whole stream */
+    if (x0 != 0 || x1 != 0 || r.ib - (r.bc >> 3) != end)
+        return -1;
+
+    *ib = end;
+
+    return 0;
+}
+
+
+/** block header **/
+
+/* Blocks start with the number of bytes the decompressed data
+   contains, in 24 bits. If it's 0, the block is an extended one:
+   a mode byte and the real size (7 bits per byte, least significant
+   first, high bit set if more bytes follow) come next */
+
+#define MODE_TREE       0x00    /* serialized tree (non-extended blocks) */
+#define MODE_CANONICAL  0x01    /* canonical code lengths */
+#define MODE_TABLE      0x02    /* codes from a static table, by id */
+#define MODE_ANS        0x03    /* tANS normalized frequencies */
+#define MODE_METHOD     0x0f    /* mask for the methods above */
+#define MODE_STREAMS    0x10    /* symbols split in interleaved streams */
+#define MODE_REPEAT     0x20    /* no lengths: codes of the previous block */
+
+/* The interleaved streams are preceded by a byte with the count of
+   streams in its low nibble and the width in bytes of the stream sizes
+   in the high one, and the sizes of all streams but the last one */
+
+/* The tANS stream is preceded by its size in bytes, stored
+   as the one in the extended header */
+
+static unsigned char *write_size(unsigned char *ob, uint64_t v)
+/* writes @v, 7 bits per byte */
+{
+    while (v > 0x7f) {
+        *ob++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+
+    *ob++ = v;
+
+    return ob;
+}
+
+
+static unsigned char *write_header(unsigned char *ob, int mode, size_t uz)
+/* writes an extended block header */
+{
+    *ob++ = 0;
+    *ob++ = 0;
+    *ob++ = 0;
+
+    *ob++ = mode;
+
+    return write_size(ob, uz);
+}
+
+
+static const unsigned char *read_header(const unsigned char *ib, int *mode,
+                                        size_t *uz, int *ok)
+/* reads a block header. @ok is set to 0 if the size is out of range */
+{
+    int im = 0x80;
+    int v24 = 0;
+
+    *ok = 1;
+    ib = read_bits(ib, &im, 24, &v24);
+
+    if (v24) {
+        *mode = MODE_TREE;
+        *uz = v24;
+    }
+    else {
+        uint64_t v = 0;
+        int s = 0;
+
+        *mode = *ib++;
+
+        do {
+            if (s > 63)
+                break;
+
+            v |= (uint64_t)(*ib & 0x7f) << s;
+            s += 7;
+        } while (*ib++ & 0x80);
+
+        if (s > 63 || v > SIZE_MAX)
+            *ok = 0;
+
+        *uz = v;
+    }
+
+    return ib;
+}
+
+
+static int safe_header(const unsigned char *ib, size_t iz,
+                       int *mode, size_t *uz)
+/* reads the header of the block of @iz bytes in @ib, never
+   reading out of them. Returns 0 or a TTCDT_HUFF_E_* error */
+{
+    /* 3 zero bytes, the mode and up to 10 of size */
+    unsigned char hb[16];
+    const unsigned char *h = ib, *p;
+    int ok;
+
+    if (iz < sizeof(hb)) {
+        memcpy(hb, ib, iz);
+        memset(hb + iz, '\0', sizeof(hb) - iz);
+        h = hb;
+    }
+
+    p = read_header(h, mode, uz, &ok);
+
+    if ((size_t)(p - h) > iz)
+        return TTCDT_HUFF_E_TRUNCATED;
+
+    return ok ? 0 : TTCDT_HUFF_E_HEADER;
+}
+
+
+/** tracing **/
+
+#ifdef TTCDT_HUFF_TRACE
+
+static void (*trace_hook)(int, size_t, uint64_t) = NULL;
+
+static uint64_t trace_clock(void)
+/* returns a monotonic time in nanoseconds */
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* a phase starts */
+#define TRACE_START(ctx) do { if (trace_hook) (ctx)->t0 = trace_clock(); } while (0)
+
+/* a phase ends; the next one starts */
+#define TRACE(ctx, ph, uz) do { if (trace_hook) { uint64_t t = trace_clock(); \
+    trace_hook(ph, uz, t - (ctx)->t0); (ctx)->t0 = t; } } while (0)
+
+#else /* TTCDT_HUFF_TRACE */
+
+#define TRACE_START(ctx)
+#define TRACE(ctx, ph, uz)
+
+#endif /* TTCDT_HUFF_TRACE */
+
+
+int ttcdt_huff_trace(void (*hook)(int phase, size_t uz, uint64_t ns))
+/* sets the trace hook */
+{
+#ifdef TTCDT_HUFF_TRACE
+    trace_hook = hook;
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+/** interface **/
+
+static void ctx_init(struct ttcdt_huff_ctx *ctx, int streams, int max_bits)
+/* initializes a context */
+{
+    ctx->streams  = streams > MAX_STREAMS ? MAX_STREAMS : streams < 1 ? 1 : streams;
+    ctx->max_bits = max_bits > 0 ? max_bits : TTCDT_HUFF_MAX_BITS;
+    ctx->repeat   = 0;
+    ctx->p_ok     = 0;
+    ctx->c_ok     = 0;
+    ctx->t_ok     = 0;
+}
+
+
+/* a context and its parts, allocated at once */
+struct ctx_mem {
+    struct ttcdt_huff_ctx ctx;  /* first, to be freed by its address */
+    struct plan p;
+    size_t s_freqs[MAX_STREAMS][256];
+    struct ans_enc ae;
+    struct table t;
+    struct multi m[1 << TABLE_BITS];
+    struct ans_dec ad;
+};
+
+
+ttcdt_huff_ctx *ttcdt_huff_ctx_new(int streams, int max_bits)
+/* creates a new context */
+{
+    ttcdt_huff_ctx *ctx = NULL;
+    struct ctx_mem *m;
+
+    if ((m = malloc(sizeof(*m))) != NULL) {
+        ctx = &m->ctx;
+
+        ctx->p       = &m->p;
+        ctx->t       = &m->t;
+        ctx->a       = &m->ad;
+        m->p.s_freqs = m->s_freqs;
+        m->p.a       = &m->ae;
+        m->p.uz      = 0;
+        m->t.m       = m->m;
+
+        ctx_init(ctx, streams, max_bits);
+    }
+
+    return ctx;
+}
+
+
+static int ctx_decoder(ttcdt_huff_ctx *ctx, struct table *t, int mode)
+/* sets up @ctx, on the stack of a context-free call, to decode
+   a block of @mode with @t. Only the tANS table is allocated
+   (to be freed by the caller). Returns -1 if there is no memory */
+{
+    ctx->p = NULL;
+    ctx->t = t;
+    ctx->a = NULL;
+    t->m   = NULL;
+
+    ctx_init(ctx, 1, 0);
+
+    if (mode == MODE_ANS && (ctx->a = malloc(sizeof(struct ans_dec))) == NULL)
+        return -1;
+
+    return 0;
+}
+
+
+void ttcdt_huff_ctx_free(ttcdt_huff_ctx *ctx)
+/* destroys a context */
+{
+    free(ctx);
+}
+
+
+void ttcdt_huff_ctx_repeat(ttcdt_huff_ctx *ctx, int repeat)
+/* sets if blocks can repeat the codes of the previous one */
+{
+    ctx->repeat = repeat;
+    ctx->p_ok   = 0;
+}
+
+
+void ttcdt_huff_ctx_reset(ttcdt_huff_ctx *ctx)
+/* forgets the codes of the previous block */
+{
+    ctx->p_ok = 0;
+    ctx->c_ok = 0;
+    ctx->t_ok = 0;
+}
+
+
+static uint64_t stream_bits(const size_t *freqs, const int *n_bits,
+                            const unsigned char *syms, int z)
+/* returns the size in bits of a stream with @freqs coded with @n_bits,
+   or UINT64_MAX if some of the symbols are not among the @z in @syms */
+{
+    int used[256];
+    uint64_t b = 0;
+    int n;
+
+    memset(used, '\0', sizeof(used));
+
+    for (n = 0; n < z; n++)
+        used[syms[n]] = 1;
+
+    for (n = 0; n < 256; n++) {
+        if (freqs[n]) {
+            if (!used[n])
+                return UINT64_MAX;
+
+            b += (uint64_t)freqs[n] * n_bits[n];
+        }
+    }
+
+    return b;
+}
+
+
+static int size_width(const int *n_bits, size_t uz, int streams)
+/* returns the bytes needed to store the sizes of @streams streams */
+{
+    uint64_t b;
+    int n, m, w;
+
+    /* the last stream is the longest; bound its size */
+    for (n = m = 0; n < 256; n++) {
+        if (n_bits[n] > m)
+            m = n_bits[n];
+    }
+
+    b = ((uint64_t)(uz - (streams - 1) * (uz / streams)) * m + 7) / 8;
+
+    for (w = 1; w < 8 && (b >> (w * 8)); w++);
+
+    return w;
+}
+
+
+static size_t header_size(const struct plan *p, const int *n_bits,
+                          int streams, int repeat)
+/* returns the size of the header of the block in @p coded with @n_bits,
+   up to the start of the streams */
+{
+    size_t sz, uz;
+
+    for (sz = 5, uz = p->uz; uz > 0x7f; uz >>= 7)
+        sz++;
+
+    if (!repeat)
+        sz += p->lz;
+
+    if (streams > 1)
+        sz += 1 + (streams - 1) * size_width(n_bits, p->uz, streams);
+
+    return sz;
+}
+
+
+static size_t block_size(const struct plan *p, const int *n_bits,
+                         const unsigned char *syms, int z, int streams, int repeat)
+/* returns the size of the block in @p coded with @n_bits,
+   or SIZE_MAX if some of its symbols are not among the @z in @syms */
+{
+    size_t sz;
+    uint64_t b;
+    int n;
+
+    sz = header_size(p, n_bits, streams, repeat);
+
+    if (streams == 1) {
+        if ((b = stream_bits(p->freqs, n_bits, syms, z)) == UINT64_MAX)
+            return SIZE_MAX;
+
+        return sz + (b + 7) / 8;
+    }
+
+    for (n = 0; n < streams; n++) {
+        if ((b = stream_bits(p->s_freqs[n], n_bits, syms, z)) == UINT64_MAX)
+            return SIZE_MAX;
+
+        sz += (b + 7) / 8;
+    }
+
+    return sz;
+}
+
+
+static void plan_ans(struct plan *p)
+/* switches the block in @p to tANS if it gets smaller */
+{
+    uint64_t v, b = 0;
+    size_t sz;
+    int n;
+
+    p->a_log = ans_log(p->uz, p->z);
+    ans_normalize(p->freqs, p->uz, p->a_log, p->a_norm);
+
+    p->az = ans_write_norm(p->a_norm, p->a_log, p->syms, p->z, p->ab) - p->ab;
+
+    /* header and stream size */
+    for (sz = 5 + p->az, v = p->uz; v > 0x7f; v >>= 7)
+        sz++;
+
+    sz++;
+
+    /* the exact size needs coding it all: first see if the
+       ideal one, from the frequencies, is worth it. Huffman
+       codes decode faster, so tANS must save at least 1/64 */
+    for (n = 0; n < 256; n++) {
+        if (p->freqs[n])
+            b += (uint64_t)(p->freqs[n] * (p->a_log - log2(p->a_norm[n])));
+    }
+
+    if (sz + b / 8 >= p->sz - p->sz / 64)
+        return;
+
+    /* context-free calls get the coding tables only now; without
+       them, the block is left with its Huffman codes */
+    if (p->a == NULL && (p->a = malloc(sizeof(struct ans_enc))) == NULL)
+        return;
+
+    ans_build_enc(p->a, p->a_norm, p->a_log);
+    p->a_bits = ans_bits(p->a, p->ib, p->uz);
+
+    for (v = (p->a_bits + 7) / 8; v > 0x7f; v >>= 7)
+        sz++;
+
+    sz += (p->a_bits + 7) / 8;
+
+    if (sz < p->sz - p->sz / 64) {
+        p->mode    = MODE_ANS;
+        p->streams = 1;
+        p->sz      = sz;
+    }
+}
+
+
+static void plan(ttcdt_huff_ctx *ctx, const unsigned char *ib, size_t uz)
+/* decides how to compress @uz bytes from @ib, leaving it in @ctx */
+{
+    struct plan *p = ctx->p;
+    int streams = ctx->streams;
+    size_t q, sz;
+    int n, m;
+
+    /* short streams are not worth the sizes, and
+       they can't be planned with no room for them */
+    if (uz / STREAM_MIN < (size_t)streams || p->s_freqs == NULL)
+        streams = 1;
+
+    TRACE_START(ctx);
+
+    /* count frequency of symbols in data, by stream if needed */
+    if (streams == 1)
+        ttcdt_huff_histogram(ib, uz, p->freqs);
+    else {
+        q = uz / streams;
+
+        for (n = 0; n < streams; n++)
+            ttcdt_huff_histogram(ib + n * q, n < streams - 1 ? q : uz - n * q,
+                                 p->s_freqs[n]);
+
+        for (m = 0; m < 256; m++) {
+            for (p->freqs[m] = 0, n = 0; n < streams; n++)
+                p->freqs[m] += p->s_freqs[n][m];
+        }
+    }
+
+    p->ib = ib;
+    p->uz = uz;
+
+    TRACE(ctx, TTCDT_HUFF_TRACE_HISTOGRAM, uz);
+
+    if (uz == 0) {
+        /* an empty block is just a header; it has no codes
+           of its own, so the next block can repeat the ones
+           before it */
+        p->z       = p->lz = 0;
+        p->mode    = MODE_CANONICAL | MODE_REPEAT;
+        p->streams = 1;
+        p->sz      = header_size(p, p->n_bits, 1, 1);
+        ctx->p_ok  = 1;
+
+        TRACE(ctx, TTCDT_HUFF_TRACE_TREE, uz);
+
+        return;
+    }
+
+    /* build the code lengths and their compressed form */
+    p->z  = ttcdt_huff_build_lengths(p->freqs, ctx->max_bits, p->n_bits, p->syms);
+    p->lz = ttcdt_huff_compress_lengths(p->syms, p->z, p->n_bits, p->lb) - p->lb;
+
+    p->mode    = MODE_CANONICAL;
+    p->streams = p->z < 2 ? 1 : streams;
+    p->sz      = block_size(p, p->n_bits, p->syms, p->z, p->streams, 0);
+
+    /* if the codes of the previous block give
+       a block no bigger, just repeat them */
+    if (ctx->repeat && ctx->c_ok) {
+        n  = ctx->z < 2 ? 1 : streams;
+        sz = block_size(p, ctx->n_bits, ctx->syms, ctx->z, n, 1);
+
+        if (sz <= p->sz) {
+            p->mode   |= MODE_REPEAT;
+            p->streams = n;
+            p->sz      = sz;
+        }
+    }
+
+    if (p->streams > 1)
+        p->mode |= MODE_STREAMS;
+
+    if (p->z > 1)
+        plan_ans(p);
+
+    ctx->p_ok = 1;
+
+    TRACE(ctx, TTCDT_HUFF_TRACE_TREE, uz);
+}
+
+
+size_t ttcdt_huff_estimate_ctx(ttcdt_huff_ctx *ctx, const unsigned char *ib, size_t uz)
+/* returns the size ttcdt_huff_compress_ctx() will compress @uz bytes
+   from @ib to, keeping the work done for it */
+{
+    plan(ctx, ib, uz);
+
+    return ctx->p->sz;
+}
+
+
+int ttcdt_huff_compressible(const unsigned char *ib, size_t uz)
+/* returns 0 if a sample of @ib shows it won't compress */
+{
+    size_t freqs[256];
+    size_t f[256];
+    int n_bits[256];
+    unsigned char syms[256];
+    size_t d, i;
+    int n, z;
+
+    /* small enough to just try */
+    if (uz < SAMPLE_MIN)
+        return 1;
+
+    memset(freqs, '\0', sizeof(freqs));
+
+    /* pieces spread evenly, from the start to the end */
+    d = (uz - SAMPLE_SLICE) / (SAMPLE_SLICES - 1);
+
+    for (i = 0; i < SAMPLE_SLICES; i++) {
+        ttcdt_huff_histogram(ib + i * d, SAMPLE_SLICE, f);
+
+        for (n = 0; n < 256; n++)
+            freqs[n] += f[n];
+    }
+
+    z = ttcdt_huff_build_lengths(freqs, TTCDT_HUFF_MAX_BITS, n_bits, syms);
+
+    /* worth it if it saves at least 1/128 */
+    return stream_bits(freqs, n_bits, syms, z) <
+           (uint64_t)SAMPLE_SLICES * SAMPLE_SLICE * 8 / 128 * 127;
+}
+
+
+unsigned char *ttcdt_huff_compress_ctx(ttcdt_huff_ctx *ctx, const unsigned char *ib,
+                                     size_t uz, unsigned char *ob)
+/* compresses @uz bytes from @ib into @ob, using @ctx.
+   Returns the pointer to the next byte of @ob */
+{
+    struct plan *p = ctx->p;
+    int *n_bits = ctx->n_bits;
+    uint32_t *codes = ctx->codes;
+    int n, streams;
+    size_t i;
+
+    /* reuse the plan from ttcdt_huff_estimate_ctx() */
+    if (!ctx->p_ok || p->ib != ib || p->uz != uz)
+        plan(ctx, ib, uz);
+
+    ctx->p_ok = 0;
+
+    TRACE_START(ctx);
+
+    if (p->mode == MODE_ANS) {
+        /* there are no Huffman codes for the next block to repeat */
+        ctx->c_ok = 0;
+
+        ob = write_header(ob, p->mode, uz);
+
+        memcpy(ob, p->ab, p->az);
+        ob += p->az;
+
+        ob = write_size(ob, (p->a_bits + 7) / 8);
+        ob = ans_encode(p->a, ib, uz, ob, p->a_bits);
+
+        TRACE(ctx, TTCDT_HUFF_TRACE_ENCODE, uz);
+
+        return ob;
+    }
+
+    if (!(p->mode & MODE_REPEAT)) {
+        /* codes are assigned in canonical order,
+           so only the lengths need to be stored */
+        memcpy(n_bits, p->n_bits, sizeof(p->n_bits));
+        memcpy(ctx->syms, p->syms, p->z);
+        ctx->z = p->z;
+        ctx->c_ok = 1;
+
+        ttcdt_huff_canonical(n_bits, codes);
+    }
+
+    streams = p->streams;
+
+    ob = write_header(ob, p->mode, uz);
+
+    if (!(p->mode & MODE_REPEAT)) {
+        memcpy(ob, p->lb, p->lz);
+        ob += p->lz;
+    }
+
+    if (streams > 1) {
+        unsigned char *sz;
+        size_t q = uz / streams;
+        int w = size_width(n_bits, uz, streams);
+
+        *ob++ = streams | (w << 4);
+
+        /* leave room for the sizes */
+        sz = ob;
+        ob += (streams - 1) * w;
+
+        for (i = 0; i < (size_t)streams; i++) {
+            unsigned char *s = ob;
+
+            if (i < (size_t)streams - 1) {
+                ob = ttcdt_huff_compress_stream(ib + i * q, q, ob, n_bits, codes);
+
+                for (n = 0; n < w; n++)
+                    *sz++ = (uint64_t)(ob - s) >> (n * 8);
+            }
+            else
+                ob = ttcdt_huff_compress_stream(ib + i * q, uz - i * q, ob, n_bits, codes);
+        }
+    }
+    else {
+        /* compress the data stream */
+        ob = ttcdt_huff_compress_stream(ib, uz, ob, n_bits, codes);
+    }
+
+    TRACE(ctx, TTCDT_HUFF_TRACE_ENCODE, uz);
+
+    return ob;
+}
+
+
+unsigned char *ttcdt_huff_compress_streams(const unsigned char *ib, size_t uz,
+                                         unsigned char *ob, int streams)
+/* compresses @uz bytes from @ib into @ob, split in @streams streams.
+   Returns the pointer to the next byte of @ob */
+{
+    ttcdt_huff_ctx ctx;
+    struct plan p;
+
+    /* a context with just the plan: the frequencies by stream
+       and the tANS tables are only allocated if they are used;
+       with no memory for them, the block goes without */
+    ctx.p     = &p;
+    ctx.t     = NULL;
+    ctx.a     = NULL;
+    p.s_freqs = NULL;
+    p.a       = NULL;
+
+    ctx_init(&ctx, streams, 0);
+
+    if (ctx.streams > 1 && uz / STREAM_MIN >= (size_t)ctx.streams)
+        p.s_freqs = malloc(ctx.streams * sizeof(*p.s_freqs));
+
+    ob = ttcdt_huff_compress_ctx(&ctx, ib, uz, ob);
+
+    free(p.s_freqs);
+    free(p.a);
+
+    return ob;
+}
+
+
+unsigned char *ttcdt_huff_compress(const unsigned char *ib, int uz, unsigned char *ob)
+/* compresses @uz bytes from @ib into @ob.
+   Returns the pointer to the next byte of @ob */
+{
+    return ttcdt_huff_compress_streams(ib, uz, ob, 1);
+}
+
+
+unsigned char *ttcdt_huff_compress_z(const unsigned char *ib, size_t uz, unsigned char *ob)
+/* compresses @uz bytes from @ib into @ob.
+   Returns the pointer to the next byte of @ob */
+{
+    return ttcdt_huff_compress_streams(ib, uz, ob, 1);
+}
+
+
+void ttcdt_huff_ctx_stats(ttcdt_huff_ctx *ctx, ttcdt_huff_stats *s)
+/* fills @s with the statistics of the last block planned in @ctx */
+{
+    struct plan *p = ctx->p;
+    const int *n_bits;
+    int n;
+
+    memset(s, '\0', sizeof(*s));
+
+    if (p->uz == 0)
+        return;
+
+    s->repeated = !!(p->mode & MODE_REPEAT);
+    s->ans      = p->mode == MODE_ANS;
+
+    /* the codes of the block */
+    n_bits = s->repeated ? ctx->n_bits : p->n_bits;
+
+    s->uz      = p->uz;
+    s->cz      = p->sz;
+    s->hz      = header_size(p, n_bits, p->streams, s->repeated);
+    s->streams = p->streams;
+
+    for (n = 0; n < 256; n++) {
+        if (p->freqs[n]) {
+            double f = (double)p->freqs[n] / p->uz;
+
+            s->symbols++;
+            s->entropy -= f * log2(f);
+            s->bits    += f * n_bits[n];
+
+            if (n_bits[n] > s->max_bits)
+                s->max_bits = n_bits[n];
+        }
+    }
+
+    if (s->ans) {
+        /* states take up to all the bits of the table */
+        s->hz       = p->sz - (p->a_bits + 7) / 8;
+        s->max_bits = p->a_log;
+        s->bits     = (double)(p->a_bits - p->a_log * 2) / p->uz;
+    }
+}
+
+
+const unsigned char *ttcdt_huff_size(const unsigned char *ib, int *uz)
+/* returns the number of bytes @ib will expand to */
+{
+    size_t z;
+    int mode, ok;
+
+    ib = read_header(ib, &mode, &z, &ok);
+
+    /* doesn't fit */
+    *uz = ok && z <= INT_MAX ? (int)z : -1;
+
+    return ib;
+}
+
+
+const unsigned char *ttcdt_huff_size_z(const unsigned char *ib, size_t *uz)
+/* returns the number of bytes @ib will expand to */
+{
+    int mode, ok;
+
+    ib = read_header(ib, &mode, uz, &ok);
+
+    if (!ok)
+        *uz = (size_t)-1;
+
+    return ib;
+}
+
+
+int ttcdt_huff_size_safe(const unsigned char *ib, size_t iz, size_t *uz)
+/* gets in @uz the number of bytes the block of @iz bytes in @ib
+   will expand to. Returns 0 or a TTCDT_HUFF_E_* error */
+{
+    int mode, ret;
+
+    if ((ret = safe_header(ib, iz, &mode, uz)) != 0)
+        *uz = (size_t)-1;
+
+    return ret;
+}
+
+
+static const unsigned char *read_table(ttcdt_huff_ctx *ctx,
+                                       const unsigned char *ib, int mode)
+/* reads the codes of a block and builds the decoding tables in @ctx.
+   Returns the pointer to the next byte of @ib, or NULL on errors */
+{
+    int n_bits[256];
+    uint32_t codes[256];
+    int single;
+
+    if (mode == MODE_TREE) {
+        struct node tree[NUM_NODES];
+        int values[256];
+        int n, r, z = 0;
+
+        /* decompress the tree, getting also the root node */
+        ib = ttcdt_huff_decompress_tree(ib, &r, tree);
+
+#ifdef TTCDT_HUFF_DEBUG
+        print_tree_raw(tree);
+#endif
+
+        /* build bits and values */
+        memset(n_bits, '\0', sizeof(n_bits));
+
+        if (ttcdt_huff_build_symbols(tree, r, 0, 0, n_bits, values, &z) == -1)
+            return NULL;
+
+        /* the tree stores the codes in reverse order */
+        for (n = 0; n < 256; n++)
+            codes[n] = n_bits[n] ? reverse_bits(values[n], n_bits[n]) : 0;
+
+        /* only a lonely root leaf has a 0-bit code */
+        single = z == 1 ? tree[r].c & 0xff : -1;
+    }
+    else
+    if ((mode & MODE_METHOD) == MODE_CANONICAL) {
+        /* the codes of the previous block are still there */
+        if (mode & MODE_REPEAT)
+            return ctx->t_ok ? ib : NULL;
+
+        /* the lengths are all that's needed */
+        ib = ttcdt_huff_decompress_lengths(ib, n_bits, codes, &single);
+
+        if (ib == NULL)
+            return NULL;
+    }
+    else
+    if (mode == MODE_ANS) {
+        int norm[256], tl;
+
+        if ((ib = ans_read_norm(ib, norm, &tl)) == NULL)
+            return NULL;
+
+        ans_build_dec(ctx->a, norm, tl);
+
+        /* blocks repeating codes can't follow this one */
+        ctx->t_ok = 0;
+
+        return ib;
+    }
+    else
+        return NULL;    /* unknown mode */
+
+    /* build the decoding tables, unless the last ones are the same */
+    if (!ctx->t_ok || ctx->t->single != single ||
+        memcmp(ctx->t->n_bits, n_bits, sizeof(n_bits)) != 0 ||
+        memcmp(ctx->t->codes, codes, sizeof(codes)) != 0) {
+        ctx->t_ok = ttcdt_huff_build_table(n_bits, codes, single, ctx->t) != -1;
+
+        if (!ctx->t_ok)
+            return NULL;
+    }
+
+    return ib;
+}
+
+
+static int safe_table(ttcdt_huff_ctx *ctx, const unsigned char *ib, size_t iz,
+                      int *mode, size_t *uz, size_t *hz)
+/* reads the header and codes of the block of @iz bytes in @ib into @ctx,
+   never reading out of them, and sets @hz to their size.
+   Returns 0 or a TTCDT_HUFF_E_* error */
+{
+    unsigned char hb[SAFE_HEADER];
+    const unsigned char *h = ib, *p;
+    int ok;
+
+    /* if the header, codes and stream sizes may go past the
+       end, read them from a copy padded with zeros; they
+       can't be longer, so they are only checked once */
+    if (iz < SAFE_HEADER) {
+        memcpy(hb, ib, iz);
+        memset(hb + iz, '\0', SAFE_HEADER - iz);
+        h = hb;
+    }
+
+    p = read_header(h, mode, uz, &ok);
+
+    if ((size_t)(p - h) > iz)
+        return TTCDT_HUFF_E_TRUNCATED;
+
+    if (!ok)
+        return TTCDT_HUFF_E_HEADER;
+
+    /* an empty block has no codes */
+    if (*uz == 0) {
+        *hz = p - h;
+        return 0;
+    }
+
+    if ((p = read_table(ctx, p, *mode)) == NULL || (size_t)(p - h) > iz) {
+        /* don't keep codes read from the padding */
+        ctx->t_ok = 0;
+        return p == NULL ? TTCDT_HUFF_E_HEADER : TTCDT_HUFF_E_TRUNCATED;
+    }
+
+    *hz = p - h;
+
+    return 0;
+}
+
+
+int ttcdt_huff_repeats(const unsigned char *ib)
+/* returns non-zero if the block repeats the previous block's codes */
+{
+    size_t uz;
+    int mode, ok;
+
+    read_header(ib, &mode, &uz, &ok);
+
+    return ok && (mode & MODE_REPEAT);
+}
+
+
+int ttcdt_huff_repeats_safe(const unsigned char *ib, size_t iz)
+/* returns non-zero if the block of @iz bytes in @ib
+   repeats the previous block's codes */
+{
+    size_t uz;
+    int mode;
+
+    return safe_header(ib, iz, &mode, &uz) == 0 && (mode & MODE_REPEAT);
+}
+
+
+int ttcdt_huff_ctx_load(ttcdt_huff_ctx *ctx, const unsigned char *ib)
+/* loads the codes of the @ib block into @ctx */
+{
+    size_t uz;
+    int mode, ok;
+
+    ib = read_header(ib, &mode, &uz, &ok);
+
+    return ok && (uz == 0 || read_table(ctx, ib, mode) != NULL) ? 0 : -1;
+}
+
+
+int ttcdt_huff_ctx_load_safe(ttcdt_huff_ctx *ctx, const unsigned char *ib,
+                             size_t iz)
+/* loads the codes of the block of @iz bytes in @ib into @ctx.
+   Returns 0 or a TTCDT_HUFF_E_* error */
+{
+    size_t uz, hz;
+    int mode;
+
+    return safe_table(ctx, ib, iz, &mode, &uz, &hz);
+}
+
+
+const unsigned char *ttcdt_huff_decompress_ctx(ttcdt_huff_ctx *ctx,
+                                             const unsigned char *ib,
+                                             unsigned char *ob)
+/* decompresses @ib into @ob, using @ctx.
+   Returns the pointer to the next byte of @ib */
+{
+    int mode, ok;
+    size_t uz;
+
+    TRACE_START(ctx);
+
+    /* take the block mode and the expected data size */
+    ib = read_header(ib, &mode, &uz, &ok);
+
+    if (!ok)
+        return NULL;
+
+    /* an empty block has no codes */
+    if (uz == 0)
+        return ib;
+
+    /* get the codes */
+    if ((ib = read_table(ctx, ib, mode)) == NULL)
+        return NULL;
+
+    TRACE(ctx, TTCDT_HUFF_TRACE_TABLE, uz);
+
+    /* decompress the stream(s) */
+    if (mode == MODE_ANS) {
+        if (decode_ans(ctx->a, &ib, NULL, uz, ob) != 0)
+            ib = NULL;
+    }
+    else
+    if (mode & MODE_STREAMS)
+        ib = ttcdt_huff_decompress_streams(ctx->t, ib, uz, ob);
+    else
+        ib = ttcdt_huff_decompress_stream(ctx->t, ib, uz, ob);
+
+    TRACE(ctx, TTCDT_HUFF_TRACE_DECODE, uz);
+
+    return ib;
+}
+
+
+int ttcdt_huff_decompress_safe_ctx(ttcdt_huff_ctx *ctx, const unsigned char *ib,
+                                   size_t iz, unsigned char *ob, size_t oz)
+/* decompresses the block of @iz bytes in @ib into the @oz bytes of @ob,
+   using @ctx, never reading or writing out of them.
+   Returns 0 or a TTCDT_HUFF_E_* error */
+{
+    const unsigned char *end = ib + iz;
+    int mode, ret;
+    size_t uz, hz;
+
+    TRACE_START(ctx);
+
+    if ((ret = safe_header(ib, iz, &mode, &uz)) != 0)
+        return ret;
+
+    /* checked before reading the codes, not to lose them */
+    if (uz > oz)
+        return TTCDT_HUFF_E_SPACE;
+
+    if ((ret = safe_table(ctx, ib, iz, &mode, &uz, &hz)) != 0 || uz == 0)
+        return ret;
+
+    ib += hz;
+
+    TRACE(ctx, TTCDT_HUFF_TRACE_TABLE, uz);
+
+    if (mode == MODE_ANS)
+        ret = decode_ans(ctx->a, &ib, end, uz, ob);
+    else
+    if (mode & MODE_STREAMS)
+        ret = decode_streams(ctx->t, &ib, end, uz, ob);
+    else
+        ret = decode_stream(ctx->t, &ib, end, uz, ob);
+
+    TRACE(ctx, TTCDT_HUFF_TRACE_DECODE, uz);
+
+    return ret == -2 ? TTCDT_HUFF_E_TRUNCATED : ret == -1 ? TTCDT_HUFF_E_DATA : 0;
+}
+
+
+int ttcdt_huff_decompress_safe(const unsigned char *ib, size_t iz,
+                               unsigned char *ob, size_t oz)
+/* decompresses the block of @iz bytes in @ib into the @oz bytes of @ob.
+   Returns 0 or a TTCDT_HUFF_E_* error */
+{
+    ttcdt_huff_ctx ctx;
+    struct table t;
+    size_t uz;
+    int mode, ret;
+
+    if ((ret = safe_header(ib, iz, &mode, &uz)) != 0)
+        return ret;
+
+    if (ctx_decoder(&ctx, &t, mode) == -1)
+        return TTCDT_HUFF_E_MEMORY;
+
+    ret = ttcdt_huff_decompress_safe_ctx(&ctx, ib, iz, ob, oz);
+
+    free(ctx.a);
+
+    return ret;
+}
 
 
 const unsigned char *ttcdt_huff_decompress(const unsigned char *ib,
@@ -435,19 +2724,490 @@ const unsigned char *ttcdt_huff_decompress(const unsigned char *ib,
 /* decompresses @ib into @ob
    Returns the pointer to the next byte of @ib */
 {
-    struct node tree[NUM_NODES];
-    int r, uz = 0;
+    ttcdt_huff_ctx ctx;
+    struct table t;
+    size_t uz;
+    int mode, ok;
 
-    /* take the expected data size */
-    ib = ttcdt_huff_size(ib, &uz);
+    read_header(ib, &mode, &uz, &ok);
 
-    /* decompress the tree, getting also the root node */
-    ib = ttcdt_huff_decompress_tree(ib, &r, tree);
+    if (ctx_decoder(&ctx, &t, mode) == -1)
+        return NULL;
 
-#ifdef TTCDT_HUFF_DEBUG
-    print_tree_raw(tree);
-#endif
+    ib = ttcdt_huff_decompress_ctx(&ctx, ib, ob);
+
+    free(ctx.a);
+
+    return ib;
+}
+
+
+/** static tables **/
+
+#define TABLE_SIG "aht"
+
+static void table_setup(ttcdt_huff_table *t)
+/* fills the codes, decoding table and id of @t from its lengths */
+{
+    uint32_t h = 2166136261u;
+    int n;
+
+    ttcdt_huff_canonical(t->n_bits, t->codes);
+
+    for (n = 0; n < 256; n++) {
+        int s = TTCDT_HUFF_TABLE_BITS - t->n_bits[n];
+        int m;
+
+        /* all entries starting with the code */
+        for (m = 0; m < 1 << s; m++)
+            t->dec[(t->codes[n] << s) + m] = n | (t->n_bits[n] << 8);
+
+        /* FNV-1a of the lengths */
+        h = (h ^ t->n_bits[n]) * 16777619u;
+    }
+
+    /* 0 means no table */
+    t->id = h ? h : 1;
+}
+
+
+void ttcdt_huff_table_train(ttcdt_huff_table *t, const size_t *freqs)
+/* builds a static table from the symbol frequencies in @freqs */
+{
+    size_t f[256];
+    unsigned char syms[256];
+    int n;
+
+    /* every symbol must have a code, even if never seen */
+    for (n = 0; n < 256; n++)
+        f[n] = freqs[n] + 1;
+
+    ttcdt_huff_build_lengths(f, TTCDT_HUFF_TABLE_BITS, t->n_bits, syms);
+
+    memset(t->dec, '\0', sizeof(t->dec));
+    table_setup(t);
+}
+
+
+unsigned char *ttcdt_huff_table_save(const ttcdt_huff_table *t, unsigned char *ob)
+/* writes @t as a table file into @ob.
+   Returns the pointer to the next byte of @ob */
+{
+    int n;
+
+    memcpy(ob, TABLE_SIG, 4);
+    ob += 4;
+
+    for (n = 0; n < 256; n++)
+        *ob++ = t->n_bits[n];
+
+    return ob;
+}
+
+
+int ttcdt_huff_table_load(ttcdt_huff_table *t, const unsigned char *ib, size_t z)
+/* loads into @t the table file of @z bytes in @ib.
+   Returns -1 if it's not a valid table file */
+{
+    int k = 0;
+    int n;
+
+    if (z != TTCDT_HUFF_TABLE_SIZE || memcmp(ib, TABLE_SIG, 4) != 0)
+        return -1;
+
+    ib += 4;
+
+    /* all symbols have codes, that must fit in the decoding table */
+    for (n = 0; n < 256; n++) {
+        if (ib[n] < 1 || ib[n] > TTCDT_HUFF_TABLE_BITS)
+            return -1;
+
+        t->n_bits[n] = ib[n];
+        k += 1 << (TTCDT_HUFF_TABLE_BITS - ib[n]);
+    }
+
+    /* Kraft inequality */
+    if (k > 1 << TTCDT_HUFF_TABLE_BITS)
+        return -1;
+
+    memset(t->dec, '\0', sizeof(t->dec));
+    table_setup(t);
+
+    return 0;
+}
+
+
+uint32_t ttcdt_huff_table_id(const unsigned char *ib)
+/* returns the id of the static table of a block, or 0 if it has none */
+{
+    size_t uz;
+    int mode, ok;
+
+    ib = read_header(ib, &mode, &uz, &ok);
+
+    if (!ok || mode != MODE_TABLE)
+        return 0;
+
+    return ib[0] | (ib[1] << 8) | (ib[2] << 16) | ((uint32_t)ib[3] << 24);
+}
+
+
+unsigned char *ttcdt_huff_compress_table(const ttcdt_huff_table *t,
+                                       const unsigned char *ib, size_t uz,
+                                       unsigned char *ob)
+/* compresses @uz bytes from @ib into @ob, using the static table @t.
+   Returns the pointer to the next byte of @ob */
+{
+    int n;
+
+    ob = write_header(ob, MODE_TABLE, uz);
+
+    /* the table is not stored, but its id */
+    for (n = 0; n < 32; n += 8)
+        *ob++ = t->id >> n;
+
+    return ttcdt_huff_compress_stream(ib, uz, ob, t->n_bits, t->codes);
+}
+
+
+const unsigned char *ttcdt_huff_decompress_table(const ttcdt_huff_table *t,
+                                               const unsigned char *ib,
+                                               unsigned char *ob)
+/* decompresses @ib into @ob, using the static table @t.
+   Returns the pointer to the next byte of @ib, or NULL if the
+   block is corrupted or was compressed with another table */
+{
+    struct reader r;
+    size_t n, uz;
+    int mode, ok;
+
+    if (ttcdt_huff_table_id(ib) != t->id)
+        return NULL;
+
+    ib = read_header(ib, &mode, &uz, &ok);
+
+    r.ib = ib + 4;
+    r.bb = 0;
+    r.bc = 0;
+
+    n = 0;
+
+    /* as in decode_rest(), the end of the stream is
+       only approached loading bytes on demand */
+    while (n + 64 < uz) {
+        int e;
+
+        refill(&r);
+
+        e = t->dec[r.bb >> (64 - TTCDT_HUFF_TABLE_BITS)];
+
+        if (e == 0)
+            return NULL;
+
+        ob[n++] = e & 0xff;
+        r.bb <<= e >> 8;
+        r.bc -= e >> 8;
+    }
+
+    while (n < uz) {
+        int e = t->dec[r.bb >> (64 - TTCDT_HUFF_TABLE_BITS)];
+
+        if (e == 0 || (e >> 8) > r.bc) {
+            if (r.bc > 56)
+                return NULL;
+
+            r.bb |= (uint64_t)*r.ib++ << (56 - r.bc);
+            r.bc += 8;
+        }
+        else {
+            ob[n++] = e & 0xff;
+            r.bb <<= e >> 8;
+            r.bc -= e >> 8;
+        }
+    }
+
+    /* unused whole bytes in the bit buffer belong to the next block */
+    return r.ib - (r.bc >> 3);
+}
+
+
+/** seekable streams **/
+
+#define SEEK_SIG "ahsk"
+#define SEEK_ENTRY 20
+#define SEEK_FOOTER 20
+
+struct ttcdt_huff_seek {
+    int n;                      /* number of blocks */
+    int a;                      /* allocated entries */
+    uint64_t *c_off;            /* offset of each block */
+    uint64_t *u_off;            /* uncompressed offset of each block */
+    uint32_t *k;                /* block with the codes of each block */
+    uint64_t cz;                /* stream size */
+    uint64_t uz;                /* uncompressed size */
+};
+
+
+static void put_le(unsigned char *ob, uint64_t v, int n)
+/* stores @n bytes of @v, little-endian */
+{
+    while (n--) {
+        *ob++ = v & 0xff;
+        v >>= 8;
+    }
+}
+
+
+static uint64_t get_le(const unsigned char *ib, int n)
+/* loads @n bytes, little-endian */
+{
+    uint64_t v = 0;
+
+    while (n--)
+        v = (v << 8) | ib[n];
+
+    return v;
+}
+
+
+ttcdt_huff_seek *ttcdt_huff_seek_new(void)
+/* creates an empty block index */
+{
+    ttcdt_huff_seek *s;
+
+    if ((s = malloc(sizeof(*s))) != NULL)
+        memset(s, '\0', sizeof(*s));
+
+    return s;
+}
+
+
+void ttcdt_huff_seek_free(ttcdt_huff_seek *s)
+/* destroys a block index */
+{
+    free(s->k);
+    free(s->u_off);
+    free(s->c_off);
+    free(s);
+}
+
+
+int ttcdt_huff_seek_add(ttcdt_huff_seek *s, const unsigned char *ib, size_t cz, size_t uz)
+/* adds the block of @cz bytes (with its size) in @ib, that expands
+   to @uz bytes. Returns -1 if there is no memory */
+{
+    int raw, k;
+
+    if (s->n == s->a) {
+        int a = s->a ? s->a * 2 : 256;
+        uint64_t *c = realloc(s->c_off, a * sizeof(uint64_t));
+        uint64_t *u = c ? realloc(s->u_off, a * sizeof(uint64_t)) : NULL;
+        uint32_t *p = u ? realloc(s->k, a * sizeof(uint32_t)) : NULL;
+
+        if (c != NULL)
+            s->c_off = c;
+        if (u != NULL)
+            s->u_off = u;
+        if (p != NULL)
+            s->k = p;
+
+        if (p == NULL)
+            return -1;
+
+        s->a = a;
+    }
+
+    raw = (int)get_le(ib, 4) <= 0;
+
+    /* a block that repeats codes takes them from the one before */
+    k = s->n;
+    if (!raw && ttcdt_huff_repeats_safe(ib + 4, cz - 4) && k > 0)
+        k = s->k[k - 1];
+
+    s->c_off[s->n] = s->cz;
+    s->u_off[s->n] = s->uz;
+    s->k[s->n]     = k;
+    s->n++;
+
+    s->cz += cz;
+    s->uz += uz;
+
+    return 0;
+}
+
+
+size_t ttcdt_huff_seek_index(const ttcdt_huff_seek *s, unsigned char *ob)
+/* writes the index into @ob (if not NULL). Returns its size */
+{
+    size_t z = 4 + (size_t)s->n * SEEK_ENTRY + SEEK_FOOTER;
+    int n;
+
+    if (ob != NULL) {
+        /* a zero size ends the blocks */
+        put_le(ob, 0, 4);
+        ob += 4;
+
+        for (n = 0; n < s->n; n++) {
+            put_le(ob, s->c_off[n], 8);
+            put_le(ob + 8, s->u_off[n], 8);
+            put_le(ob + 16, s->k[n], 4);
+            ob += SEEK_ENTRY;
+        }
+
+        put_le(ob, s->n, 8);
+        put_le(ob + 8, s->uz, 8);
+        memcpy(ob + 16, SEEK_SIG, 4);
+    }
+
+    return z;
+}
+
+
+static int range_block(ttcdt_huff_ctx *ctx, const unsigned char *ib, size_t iz,
+                       const unsigned char *x, uint64_t n, uint64_t *loaded,
+                       size_t uz, unsigned char *ob)
+/* decompresses the block @n of the index in @x into the
+   @uz bytes of @ob. Returns -1 on errors */
+{
+    const unsigned char *e = x + n * SEEK_ENTRY;
+    uint64_t o = get_le(e, 8);
+    uint64_t k = get_le(e + 16, 4);
+    int64_t z;
+    size_t bz;
+
+    if (o + 4 > iz)
+        return -1;
+
+    z = (int32_t)get_le(ib + o, 4);
+    o += 4;
+
+    if (z <= 0) {
+        /* uncompressed */
+        if ((uint64_t)-z != uz || o - z > iz)
+            return -1;
+
+        memcpy(ob, ib + o, uz);
+        return 0;
+    }
+
+    if (o + z > iz)
+        return -1;
+
+    if (ttcdt_huff_size_safe(ib + o, z, &bz) != 0 || bz != uz)
+        return -1;
+
+    /* load the codes this block repeats, if not there yet */
+    if (ttcdt_huff_repeats_safe(ib + o, z) && k != *loaded) {
+        uint64_t ko;
+        int64_t kz;
+
+        if (k >= n)
+            return -1;
+
+        ko = get_le(x + k * SEEK_ENTRY, 8);
+
+        if (ko + 4 > iz)
+            return -1;
+
+        kz = (int32_t)get_le(ib + ko, 4);
+
+        if (kz <= 0 || ko + 4 + kz > iz ||
+            ttcdt_huff_ctx_load_safe(ctx, ib + ko + 4, kz) != 0)
+            return -1;
+    }
+
+    if (ttcdt_huff_decompress_safe_ctx(ctx, ib + o, z, ob, uz) != 0)
+        return -1;
+
+    *loaded = k;
+
+    return 0;
+}
+
+
+int ttcdt_huff_decompress_range(const unsigned char *ib, size_t iz,
+                                uint64_t from, size_t z, unsigned char *ob)
+/* decompresses @z bytes from offset @from of the seekable stream
+   of @iz bytes in @ib into @ob. Returns -1 on errors */
+{
+    ttcdt_huff_ctx *ctx;
+    const unsigned char *x, *f;
+    unsigned char *tb = NULL;
+    uint64_t n, l, h, uz, loaded = (uint64_t)-1;
+    int ret = 0;
+
+    if (iz < 4 + SEEK_FOOTER)
+        return -1;
+
+    f  = ib + iz - SEEK_FOOTER;
+    n  = get_le(f, 8);
+    uz = get_le(f + 8, 8);
+
+    if (memcmp(f + 16, SEEK_SIG, 4) != 0 ||
+        n > (iz - 4 - SEEK_FOOTER) / SEEK_ENTRY ||
+        from > uz || z > uz - from)
+        return -1;
+
+    if (z == 0)
+        return 0;
+
+    x = f - n * SEEK_ENTRY;
+
+    /* binary search of the block where @from is */
+    for (l = 0, h = n; h - l > 1; ) {
+        uint64_t m = (l + h) / 2;
+
+        if (get_le(x + m * SEEK_ENTRY + 8, 8) <= from)
+            l = m;
+        else
+            h = m;
+    }
+
+    if ((ctx = ttcdt_huff_ctx_new(1, 0)) == NULL)
+        return -1;
+
+    for (; z > 0 && l < n && ret == 0; l++) {
+        uint64_t s = get_le(x + l * SEEK_ENTRY + 8, 8);
+        uint64_t e = l + 1 < n ? get_le(x + (l + 1) * SEEK_ENTRY + 8, 8) : uz;
+        size_t bz, c;
+
+        if (e < s || s > from) {
+            ret = -1;
+            break;
+        }
+
+        bz = e - s;
+        c  = from - s;
+
+        if (c == 0 && bz <= z) {
+            /* the whole block is wanted */
+            ret = range_block(ctx, ib, x - ib, x, l, &loaded, bz, ob);
+        }
+        else {
+            /* only part: decompress it elsewhere */
+            unsigned char *p = realloc(tb, bz + 1);
+
+            if (p == NULL)
+                ret = -1;
+            else {
+                tb  = p;
+                ret = range_block(ctx, ib, x - ib, x, l, &loaded, bz, tb);
+                bz  = bz - c < z ? bz - c : z;
+
+                memcpy(ob, tb + c, bz);
+            }
+        }
+
+        from += bz;
+        ob   += bz;
+        z    -= bz;
+    }
+
+    if (z > 0)
+        ret = -1;
+
+    free(tb);
+    ttcdt_huff_ctx_free(ctx);
 
-    /* decompress the stream */
-    return ttcdt_huff_decompress_stream(tree, r, ib, uz, ob);
+    return ret;
 }
@@ -8,7 +8,18 @@
 
 */
 
-#define TTCDT_HUFF_VERSION "1.06"
+#ifndef TTCDT_HUFF_H
+#define TTCDT_HUFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TTCDT_HUFF_VERSION "2.00"
+
+/* worst-case size of a compressed block of @uz bytes: the codes
+   never take more than a byte per symbol, plus the header (data
+   size, code lengths and stream sizes) and the stream padding */
+#define TTCDT_HUFF_BOUND(uz) ((uz) + 600)
 
 /**
  * ttcdt_huff_compress - Compresses a block of data.
@@ -17,26 +28,104 @@
  * @ob: output buffer
  *
  * Compresses the @ib block of @uz bytes into the buffer
- * pointed by @ob. @uz must be non-zero. @ob must
- * be at least @uz size.
+ * pointed by @ob. An empty block (@uz 0) is stored as its
+ * header alone. @ob must be at least TTCDT_HUFF_BOUND(@uz)
+ * bytes; data that doesn't compress grows a bit (typically
+ * some 140 bytes for random data).
  *
- * Returns the pointer to the next byte in @ib.
+ * The data is coded with Huffman codes or, if that makes the
+ * block noticeably smaller (as with very skewed data, where
+ * symbols take less than a bit), with table-based asymmetric
+ * numeral systems (tANS), a finite state machine that codes
+ * symbols in fractional numbers of bits.
+ *
+ * The working space is on the stack; only the tables to try
+ * tANS are allocated, and if there is no memory for them the
+ * block keeps its Huffman codes. Use a context (see
+ * ttcdt_huff_ctx_new()) to compress many blocks.
+ *
+ * Returns the pointer to the next byte in @ob, past
+ * the compressed block.
  */
 unsigned char *ttcdt_huff_compress(const unsigned char *ib, int uz,
                                  unsigned char *ob);
 
+/**
+ * ttcdt_huff_compress_z - Compresses a block of data of any size.
+ * @ib: input buffer
+ * @uz: data size in bytes
+ * @ob: output buffer
+ *
+ * Compresses the @ib block of @uz bytes into the buffer
+ * pointed by @ob, as ttcdt_huff_compress() does, but with
+ * no limit in the size of the block.
+ *
+ * Returns the pointer to the next byte in @ob.
+ */
+unsigned char *ttcdt_huff_compress_z(const unsigned char *ib, size_t uz,
+                                   unsigned char *ob);
+
+/**
+ * ttcdt_huff_compress_streams - Compresses a block of data in several streams.
+ * @ib: input buffer
+ * @uz: data size in bytes
+ * @ob: output buffer
+ * @streams: number of streams
+ *
+ * Compresses the @ib block of @uz bytes into the buffer
+ * pointed by @ob, as ttcdt_huff_compress() does, but splitting
+ * the data in up to 15 streams that can be decoded in parallel
+ * on decompression. Blocks too small to be worth it are stored
+ * as a single stream, as they are if there is no memory to
+ * count the symbols of each stream.
+ *
+ * Returns the pointer to the next byte in @ob.
+ */
+unsigned char *ttcdt_huff_compress_streams(const unsigned char *ib, size_t uz,
+                                         unsigned char *ob, int streams);
+
 /**
  * ttcdt_huff_size - Gets the size of stored data.
  * @ib: input buffer
  * @uz: pointer to store the uncompressed data size.
  *
  * Gets the number of bytes @ib will expand to
- * after decompression.
+ * after decompression. It's set to -1 if the block
+ * is corrupted or the size doesn't fit in an int.
  *
  * Returns the pointer to the next byte in @ib.
  */
 const unsigned char *ttcdt_huff_size(const unsigned char *ib, int *uz);
 
+/**
+ * ttcdt_huff_size_z - Gets the size of stored data of any size.
+ * @ib: input buffer
+ * @uz: pointer to store the uncompressed data size.
+ *
+ * Gets the number of bytes @ib will expand to after
+ * decompression, as ttcdt_huff_size() does, but with no
+ * limit in the size. It's set to (size_t)-1 if the block
+ * is corrupted.
+ *
+ * Returns the pointer to the next byte in @ib.
+ */
+const unsigned char *ttcdt_huff_size_z(const unsigned char *ib, size_t *uz);
+
+/**
+ * ttcdt_huff_size_safe - Gets the size of stored data from untrusted input.
+ * @ib: input buffer
+ * @iz: size of the compressed block in @ib
+ * @uz: pointer to store the uncompressed data size.
+ *
+ * Gets the number of bytes the compressed block of @iz bytes
+ * in @ib will expand to, as ttcdt_huff_size_z() does, but
+ * never reading past @iz bytes. It's set to (size_t)-1 if
+ * the block is corrupted or truncated.
+ *
+ * Returns 0, TTCDT_HUFF_E_TRUNCATED or TTCDT_HUFF_E_HEADER.
+ */
+int ttcdt_huff_size_safe(const unsigned char *ib, size_t iz, size_t *uz);
+
 /**
  * ttcdt_huff_decompress - Decompresses a block of compressed data.
  * @ib: input buffer
@@ -46,7 +135,459 @@ const unsigned char *ttcdt_huff_size(const unsigned char *ib, int *uz);
  * buffer pointed by @ob. The buffer must have enough
  * size for the uncompressed block (see ttcdt_huff_size()).
  *
- * Returns the pointer to the next byte in @ib.
+ * The working space is on the stack, except the decoding
+ * table of tANS blocks.
+ *
+ * Returns the pointer to the next byte in @ib, or NULL
+ * if the block is corrupted, or it's a tANS block and
+ * there is no memory for its table.
  */
 const unsigned char *ttcdt_huff_decompress(const unsigned char *ib,
                                          unsigned char *ob);
+
+/* errors returned by ttcdt_huff_decompress_safe() */
+#define TTCDT_HUFF_E_TRUNCATED  -1  /* the input ends before the block */
+#define TTCDT_HUFF_E_HEADER     -2  /* bad block header or codes */
+#define TTCDT_HUFF_E_DATA       -3  /* invalid codes in the data */
+#define TTCDT_HUFF_E_SPACE      -4  /* the output buffer is too small */
+#define TTCDT_HUFF_E_MEMORY     -5  /* no memory for the tANS decoding table */
+
+/**
+ * ttcdt_huff_decompress_safe - Decompresses an untrusted block.
+ * @ib: input buffer
+ * @iz: size of @ib
+ * @ob: output buffer
+ * @oz: size of @ob
+ *
+ * Decompresses the compressed data block in @ib into the
+ * buffer pointed by @ob, as ttcdt_huff_decompress() does,
+ * but never reading past the @iz bytes of @ib nor writing
+ * past the @oz bytes of @ob, so it can be used on data
+ * from untrusted sources. The header and the codes are
+ * checked once, and the data is decoded without checks
+ * while it's known to be far from the end of @ib.
+ *
+ * Returns 0, or one of the TTCDT_HUFF_E_ errors if the
+ * block is truncated or corrupted or doesn't fit in @ob,
+ * or it's a tANS block and there is no memory for its table.
+ */
+int ttcdt_huff_decompress_safe(const unsigned char *ib, size_t iz,
+                               unsigned char *ob, size_t oz);
+
+/**
+ * ttcdt_huff_histogram - Counts the frequency of bytes.
+ * @ib: input buffer
+ * @uz: data size in bytes
+ * @freqs: array of 256 counters
+ *
+ * Stores in @freqs how many times each byte value appears
+ * in the @uz bytes of @ib. This is the first pass of
+ * the compressor.
+ */
+void ttcdt_huff_histogram(const unsigned char *ib, size_t uz, size_t *freqs);
+
+typedef struct ttcdt_huff_ctx ttcdt_huff_ctx;
+
+/**
+ * ttcdt_huff_ctx_new - Creates a compression/decompression context.
+ * @streams: number of interleaved streams per block (1: none)
+ * @max_bits: longest code to produce (0: default)
+ *
+ * Creates a context that can be used with ttcdt_huff_compress_ctx()
+ * and ttcdt_huff_decompress_ctx(). It holds the working space
+ * and decoding tables between calls, so the per-call setup cost
+ * is paid only once. A context must only be used by one thread
+ * at a time.
+ *
+ * Returns the new context, or NULL if there is no memory.
+ */
+ttcdt_huff_ctx *ttcdt_huff_ctx_new(int streams, int max_bits);
+
+/**
+ * ttcdt_huff_ctx_free - Destroys a context.
+ * @ctx: the context
+ *
+ * Frees a context created by ttcdt_huff_ctx_new().
+ */
+void ttcdt_huff_ctx_free(ttcdt_huff_ctx *ctx);
+
+/**
+ * ttcdt_huff_ctx_repeat - Enables repeating codes between blocks.
+ * @ctx: the context
+ * @repeat: non-zero to enable
+ *
+ * When enabled, ttcdt_huff_compress_ctx() stores blocks without
+ * code lengths if the codes of the previous block compress them
+ * as well as their own would. These blocks can only be decompressed
+ * by a context that has just decompressed (or loaded with
+ * ttcdt_huff_ctx_load()) the block they follow. It's disabled
+ * by default.
+ */
+void ttcdt_huff_ctx_repeat(ttcdt_huff_ctx *ctx, int repeat);
+
+/**
+ * ttcdt_huff_ctx_reset - Forgets the codes of the previous block.
+ * @ctx: the context
+ *
+ * Makes the next block compressed with @ctx have its own codes.
+ * It must be called when a compressed block is not stored
+ * (for example, because it's stored uncompressed instead),
+ * so that the next one doesn't repeat codes the decompressor
+ * will never see.
+ */
+void ttcdt_huff_ctx_reset(ttcdt_huff_ctx *ctx);
+
+/**
+ * ttcdt_huff_compress_ctx - Compresses a block of data using a context.
+ * @ctx: the context
+ * @ib: input buffer
+ * @uz: data size in bytes
+ * @ob: output buffer
+ *
+ * Compresses the @ib block of @uz bytes into the buffer
+ * pointed by @ob, as ttcdt_huff_compress_z() does, using
+ * the settings and working space in @ctx.
+ *
+ * Returns the pointer to the next byte in @ob.
+ */
+unsigned char *ttcdt_huff_compress_ctx(ttcdt_huff_ctx *ctx, const unsigned char *ib,
+                                     size_t uz, unsigned char *ob);
+
+/**
+ * ttcdt_huff_estimate_ctx - Tells the size of a block before compressing it.
+ * @ctx: the context
+ * @ib: input buffer
+ * @uz: data size in bytes
+ *
+ * Returns the exact size in bytes ttcdt_huff_compress_ctx() will
+ * produce for the @ib block of @uz bytes, without writing it.
+ * Callers can then store the data uncompressed if it's not worth
+ * it. The work is kept in @ctx, so if the next call is
+ * ttcdt_huff_compress_ctx() with the same, unmodified @ib and @uz,
+ * it only has to write the bits.
+ */
+size_t ttcdt_huff_estimate_ctx(ttcdt_huff_ctx *ctx, const unsigned char *ib, size_t uz);
+
+/**
+ * ttcdt_huff_compressible - Tells if data looks worth compressing.
+ * @ib: input buffer
+ * @uz: data size in bytes
+ *
+ * Looks at a few evenly spread pieces of big inputs (of 1 MiB or
+ * more) and tells if compressing them would save anything. It's
+ * a quick way of skipping already compressed data; as it's just
+ * a sample, a non-zero return doesn't guarantee any savings.
+ *
+ * Returns 0 if the data is not worth compressing.
+ */
+int ttcdt_huff_compressible(const unsigned char *ib, size_t uz);
+
+/**
+ * ttcdt_huff_decompress_ctx - Decompresses a block using a context.
+ * @ctx: the context
+ * @ib: input buffer
+ * @ob: output buffer
+ *
+ * Decompresses the compressed data block in @ib into the
+ * buffer pointed by @ob, as ttcdt_huff_decompress() does.
+ * The decoding tables are kept in @ctx, and not rebuilt if
+ * the next block uses the same codes.
+ *
+ * Returns the pointer to the next byte in @ib, or NULL
+ * if the block is corrupted.
+ */
+const unsigned char *ttcdt_huff_decompress_ctx(ttcdt_huff_ctx *ctx,
+                                             const unsigned char *ib,
+                                             unsigned char *ob);
+
+/**
+ * ttcdt_huff_decompress_safe_ctx - Decompresses an untrusted block using a context.
+ * @ctx: the context
+ * @ib: input buffer
+ * @iz: size of @ib
+ * @ob: output buffer
+ * @oz: size of @ob
+ *
+ * Decompresses the compressed data block in @ib into the
+ * buffer pointed by @ob, as ttcdt_huff_decompress_safe()
+ * does, keeping the decoding tables in @ctx as
+ * ttcdt_huff_decompress_ctx() does.
+ *
+ * Returns 0, or one of the TTCDT_HUFF_E_ errors.
+ */
+int ttcdt_huff_decompress_safe_ctx(ttcdt_huff_ctx *ctx, const unsigned char *ib,
+                                   size_t iz, unsigned char *ob, size_t oz);
+
+/**
+ * ttcdt_huff_repeats - Tells if a block repeats the previous codes.
+ * @ib: input buffer
+ *
+ * Returns non-zero if the compressed block in @ib has no codes
+ * of its own, but repeats those of the block before it.
+ */
+int ttcdt_huff_repeats(const unsigned char *ib);
+
+/**
+ * ttcdt_huff_repeats_safe - Tells if an untrusted block repeats the previous codes.
+ * @ib: input buffer
+ * @iz: size of the compressed block in @ib
+ *
+ * Returns non-zero if the compressed block of @iz bytes in @ib
+ * repeats the codes of the block before it, as ttcdt_huff_repeats()
+ * does, but never reading past @iz bytes. A truncated or corrupted
+ * block returns zero.
+ */
+int ttcdt_huff_repeats_safe(const unsigned char *ib, size_t iz);
+
+/**
+ * ttcdt_huff_ctx_load - Loads the codes of a block into a context.
+ * @ctx: the context
+ * @ib: input buffer
+ *
+ * Builds the decoding tables of @ctx from the codes of the
+ * compressed block in @ib, without decompressing it, so that
+ * blocks repeating its codes can be decompressed by @ctx.
+ *
+ * Returns 0, or -1 if the block is corrupted or repeats codes
+ * @ctx doesn't have.
+ */
+int ttcdt_huff_ctx_load(ttcdt_huff_ctx *ctx, const unsigned char *ib);
+
+/**
+ * ttcdt_huff_ctx_load_safe - Loads the codes of an untrusted block into a context.
+ * @ctx: the context
+ * @ib: input buffer
+ * @iz: size of the compressed block in @ib
+ *
+ * Loads the codes of the compressed block of @iz bytes in @ib
+ * into @ctx, as ttcdt_huff_ctx_load() does, but never reading
+ * past @iz bytes.
+ *
+ * Returns 0, or one of the TTCDT_HUFF_E_ errors.
+ */
+int ttcdt_huff_ctx_load_safe(ttcdt_huff_ctx *ctx, const unsigned char *ib,
+                             size_t iz);
+
+typedef struct {
+    size_t uz;          /* uncompressed size */
+    size_t cz;          /* compressed size */
+    size_t hz;          /* header size (block header, codes and stream sizes) */
+    int symbols;        /* number of distinct symbols */
+    int max_bits;       /* longest code used */
+    int streams;        /* number of interleaved streams */
+    int repeated;       /* the codes of the previous block were repeated */
+    int ans;            /* coded with tANS instead of Huffman codes */
+    double entropy;     /* Shannon entropy, in bits per symbol */
+    double bits;        /* average code length, in bits per symbol */
+} ttcdt_huff_stats;
+
+/**
+ * ttcdt_huff_ctx_stats - Gets statistics of the last block.
+ * @ctx: the context
+ * @s: structure to fill
+ *
+ * Fills @s with the statistics of the last block compressed
+ * (or estimated) with @ctx: the distance between the entropy and
+ * the average code length shows how good a fit the coding is
+ * for the data. For tANS blocks, the average code length is the
+ * bits the stream takes per symbol, and the longest code the
+ * bits of a state. It's all zero if there is no such block.
+ * They are only computed when asked for, so they cost nothing
+ * to blocks not looked at.
+ */
+void ttcdt_huff_ctx_stats(ttcdt_huff_ctx *ctx, ttcdt_huff_stats *s);
+
+/* phases reported to the trace hook */
+#define TTCDT_HUFF_TRACE_HISTOGRAM  0   /* counting the symbols */
+#define TTCDT_HUFF_TRACE_TREE       1   /* building the code lengths */
+#define TTCDT_HUFF_TRACE_ENCODE     2   /* writing the block */
+#define TTCDT_HUFF_TRACE_TABLE      3   /* reading the codes and building tables */
+#define TTCDT_HUFF_TRACE_DECODE     4   /* decoding the streams */
+
+/**
+ * ttcdt_huff_trace - Sets the trace hook.
+ * @hook: function to call (NULL: none)
+ *
+ * Sets a function to be called after each phase of the
+ * compression and decompression of a block made with a
+ * context, with the phase, the uncompressed size of the
+ * block and the time it took in nanoseconds. It can feed
+ * counters or probe points. It's called from the thread
+ * doing the work, so it must be thread-safe if contexts
+ * are used from several threads; it should be set before
+ * any of them starts.
+ *
+ * Tracing is only compiled in if the library is built
+ * with TTCDT_HUFF_TRACE defined; otherwise, the hook is
+ * never called and this returns -1.
+ *
+ * Returns 0, or -1 if tracing is not available.
+ */
+int ttcdt_huff_trace(void (*hook)(int phase, size_t uz, uint64_t ns));
+
+/* longest code in a static table */
+#define TTCDT_HUFF_TABLE_BITS 11
+
+/* size of a table file */
+#define TTCDT_HUFF_TABLE_SIZE 260
+
+/* a static code table. It's public so that it can be compiled in
+   (see ttcdt-huff-train), but its fields must be taken as read-only */
+typedef struct ttcdt_huff_table {
+    uint32_t id;                /* identifier, stored in the blocks */
+    int n_bits[256];            /* code lengths */
+    uint32_t codes[256];        /* codes, as written to the stream */
+    uint16_t dec[1 << TTCDT_HUFF_TABLE_BITS];   /* symbol | length << 8 */
+} ttcdt_huff_table;
+
+/**
+ * ttcdt_huff_table_train - Builds a static code table.
+ * @t: the table
+ * @freqs: frequency of each of the 256 symbols
+ *
+ * Builds into @t the codes for data with the symbol frequencies
+ * in @freqs, usually the sum of ttcdt_huff_histogram() over
+ * a set of representative messages. All symbols get a code,
+ * so any data can be compressed with the table.
+ */
+void ttcdt_huff_table_train(ttcdt_huff_table *t, const size_t *freqs);
+
+/**
+ * ttcdt_huff_table_save - Writes a static table as a table file.
+ * @t: the table
+ * @ob: output buffer
+ *
+ * Writes the TTCDT_HUFF_TABLE_SIZE bytes of the table file
+ * of @t into @ob.
+ *
+ * Returns the pointer to the next byte in @ob.
+ */
+unsigned char *ttcdt_huff_table_save(const ttcdt_huff_table *t, unsigned char *ob);
+
+/**
+ * ttcdt_huff_table_load - Loads a static table from a table file.
+ * @t: the table
+ * @ib: input buffer
+ * @z: size of @ib
+ *
+ * Rebuilds into @t the table saved in @ib by ttcdt_huff_table_save().
+ *
+ * Returns 0, or -1 if @ib is not a valid table file.
+ */
+int ttcdt_huff_table_load(ttcdt_huff_table *t, const unsigned char *ib, size_t z);
+
+/**
+ * ttcdt_huff_table_id - Tells the static table a block needs.
+ * @ib: input buffer
+ *
+ * Returns the id of the table the compressed block in @ib
+ * was compressed with, or 0 if it doesn't use a static table.
+ */
+uint32_t ttcdt_huff_table_id(const unsigned char *ib);
+
+/**
+ * ttcdt_huff_compress_table - Compresses a block with a static table.
+ * @t: the table
+ * @ib: input buffer
+ * @uz: data size in bytes
+ * @ob: output buffer
+ *
+ * Compresses the @ib block of @uz bytes into the buffer
+ * pointed by @ob using the codes in @t. Only the id of the
+ * table is stored, so it's best suited for small messages.
+ * @ob must be at least 20 + @uz * TTCDT_HUFF_TABLE_BITS / 8
+ * bytes long.
+ *
+ * Returns the pointer to the next byte in @ob.
+ */
+unsigned char *ttcdt_huff_compress_table(const ttcdt_huff_table *t,
+                                       const unsigned char *ib, size_t uz,
+                                       unsigned char *ob);
+
+/**
+ * ttcdt_huff_decompress_table - Decompresses a block with a static table.
+ * @t: the table
+ * @ib: input buffer
+ * @ob: output buffer
+ *
+ * Decompresses the block in @ib, compressed by
+ * ttcdt_huff_compress_table() with the same table, into
+ * the buffer pointed by @ob.
+ *
+ * Returns the pointer to the next byte in @ib, or NULL
+ * if the block is corrupted or uses another table.
+ */
+const unsigned char *ttcdt_huff_decompress_table(const ttcdt_huff_table *t,
+                                               const unsigned char *ib,
+                                               unsigned char *ob);
+
+/*
+    Seekable streams, as written by ttcdt-huff -C -S: a sequence of
+    blocks, each one prefixed by its size as a 4-byte little-endian
+    signed integer (negative: stored uncompressed), a zero size,
+    and an index with the offsets of all the blocks.
+*/
+
+typedef struct ttcdt_huff_seek ttcdt_huff_seek;
+
+/**
+ * ttcdt_huff_seek_new - Creates a block index.
+ *
+ * Creates an empty index for a seekable stream.
+ *
+ * Returns the new index, or NULL if there is no memory.
+ */
+ttcdt_huff_seek *ttcdt_huff_seek_new(void);
+
+/**
+ * ttcdt_huff_seek_free - Destroys a block index.
+ * @s: the index
+ */
+void ttcdt_huff_seek_free(ttcdt_huff_seek *s);
+
+/**
+ * ttcdt_huff_seek_add - Adds a block to an index.
+ * @s: the index
+ * @ib: the block, with its size prefix
+ * @cz: size of the block, with its size prefix
+ * @uz: size of the data in the block
+ *
+ * Adds to @s the next block of the stream. Blocks repeating
+ * the codes of the previous one are tracked, so that they
+ * can be decompressed on their own.
+ *
+ * Returns 0, or -1 if there is no memory.
+ */
+int ttcdt_huff_seek_add(ttcdt_huff_seek *s, const unsigned char *ib, size_t cz, size_t uz);
+
+/**
+ * ttcdt_huff_seek_index - Writes a block index.
+ * @s: the index
+ * @ob: output buffer (or NULL)
+ *
+ * Writes the end of the blocks and the index of @s into @ob,
+ * to be appended to the stream.
+ *
+ * Returns the size of the index (also if @ob is NULL).
+ */
+size_t ttcdt_huff_seek_index(const ttcdt_huff_seek *s, unsigned char *ob);
+
+/**
+ * ttcdt_huff_decompress_range - Decompresses part of a seekable stream.
+ * @ib: the seekable stream
+ * @iz: size of @ib
+ * @from: offset in the uncompressed data
+ * @z: bytes to decompress
+ * @ob: output buffer
+ *
+ * Decompresses @z bytes from offset @from of the data in the
+ * seekable stream @ib into @ob. Only the blocks holding them
+ * (and those with the codes they repeat) are read.
+ *
+ * Returns 0, or -1 if the stream is corrupted or the range
+ * is out of it.
+ */
+int ttcdt_huff_decompress_range(const unsigned char *ib, size_t iz,
+                                uint64_t from, size_t z, unsigned char *ob);
+
+#endif /* TTCDT_HUFF_H */